@@ -32,6 +32,21 @@ struct ashmem_pin {
 	__u32 len;	/* length forward from offset, in bytes, page-aligned */
 };
 
+/*
+ * For ASHMEM_PIN_VEC and ASHMEM_UNPIN_VEC: 'nr' ranges, at most
+ * ASHMEM_PIN_VEC_MAX, processed in order. If 'results' is not zero, what
+ * ASHMEM_PIN or ASHMEM_UNPIN would have returned for each range is stored in
+ * the __u32 array it points to.
+ */
+struct ashmem_pin_vec {
+	__u64 pins;	/* user address of an array of struct ashmem_pin */
+	__u64 results;	/* user address of an array of __u32, or zero */
+	__u32 nr;	/* number of ranges */
+	__u32 __pad;
+};
+
+#define ASHMEM_PIN_VEC_MAX	1024
+
 #define __ASHMEMIOC		0x77
 
 #define ASHMEM_SET_NAME		_IOW(__ASHMEMIOC, 1, char[ASHMEM_NAME_LEN])
@@ -44,5 +59,7 @@ struct ashmem_pin {
 #define ASHMEM_UNPIN		_IOW(__ASHMEMIOC, 8, struct ashmem_pin)
 #define ASHMEM_GET_PIN_STATUS	_IO(__ASHMEMIOC, 9)
 #define ASHMEM_PURGE_ALL_CACHES	_IO(__ASHMEMIOC, 10)
+#define ASHMEM_PIN_VEC		_IOW(__ASHMEMIOC, 11, struct ashmem_pin_vec)
+#define ASHMEM_UNPIN_VEC	_IOW(__ASHMEMIOC, 12, struct ashmem_pin_vec)
 
 #endif	/* _LINUX_ASHMEM_H */
@@ -25,6 +25,10 @@
 #include <linux/sched.h>
 #include <linux/slab.h>
 #include <linux/rbtree.h>
+#include <linux/rculist.h>
+#include <linux/radix-tree.h>
+#include <linux/percpu.h>
+#include <linux/hash.h>
 #include <linux/poll.h>
 #include <linux/spinlock.h>
 #include <linux/uaccess.h>
@@ -37,14 +41,20 @@
 #include "msg_queue.h"
 #include "fast_slob.h"
 #include "binder.h"
+#include "inst.h"
 
+#define CREATE_TRACE_POINTS
+#include "binder_new_trace.h"
 
-#define OBJ_HASH_BUCKET_SIZE			128
+
+#define OBJ_HASH_MIN_BITS			7
+#define OBJ_HASH_MAX_BITS			16
 #define MAX_TRACE_DEPTH				4
 #define MSG_BUF_ALIGN(n)			(((n) & (sizeof(void *) - 1)) ? ALIGN((n), sizeof(void *)) : (n))
 #define OBJ_IS_BINDER(o)			((o)->owner_queue)
 #define OBJ_IS_HANDLE(o)			(!OBJ_IS_BINDER(o))
-#define DUMP_MSG(pid, tid, wrt, msg)		//_dump_msg(pid, tid, wrt, msg)
+#define LAT_HIST_SIZE				32	// log2(ns) buckets, the last one taking all above
+#define READ_BATCH_SIZE				16
 
 
 enum {	// compat: review looper idea
@@ -59,14 +69,41 @@ typedef enum {
 } binder_event_t;
 
 
+/* Objects are hashed by (owner, binder), in a table that doubles in size as objects are added.
+   Lookups are lockless under RCU, while obj_lock serializes changes. Each object has two hash
+   nodes, so it can be linked into a new table while readers may still be walking the old one
+   through the other node. The old table is retired after a grace period, and there's no
+   further resizing until then. */
+struct binder_obj_table {
+	unsigned int bits;
+	int gen;			// which of the objects' hash nodes this table uses
+
+	struct binder_proc *proc;
+	struct rcu_head rcu;
+
+	struct hlist_head buckets[0];
+};
+
+struct binder_obj_stats {
+	unsigned long lookups, ref_lookups, misses;
+};
+
+struct binder_lat_stats {
+	unsigned long queue[LAT_HIST_SIZE];	// transaction or reply enqueued -> dequeued
+	unsigned long call[LAT_HIST_SIZE];	// transaction sent -> reply received, by the caller
+};
+
 struct binder_proc {
 	spinlock_t lock;
 	struct rb_root thread_tree;
 
 	spinlock_t obj_lock;
-	struct rb_root obj_tree;
-	struct hlist_head obj_hash[OBJ_HASH_BUCKET_SIZE];
-	unsigned long obj_seq;
+	struct binder_obj_table *obj_table;
+	struct binder_obj_table *obj_table_retired;
+	struct radix_tree_root obj_refs;	// ref -> object, looked up under RCU too
+	unsigned long obj_seq, obj_count;
+	struct binder_obj_stats __percpu *obj_stats;
+	struct binder_lat_stats __percpu *lat_stats;
 
 	struct msg_queue *queue;
 
@@ -97,6 +134,9 @@ struct binder_thread {
 	int pending_replies;
 	struct list_head incoming_transactions;
 
+	size_t num_pending_cmds;
+	struct list_head pending_cmds;	// commands to ourselves, see binder_flush_cmds()
+
 	struct binder_proc *proc;
 	struct dentry *info_node;
 };
@@ -115,10 +155,9 @@ struct binder_obj {
 	void *binder;
 	void *cookie;
 
-	struct rb_node rb_node;
-
 	unsigned long ref;
-	struct hlist_node hash_node;
+	struct hlist_node hash_node[2];
+	struct rcu_head rcu;
 
 	atomic_t refs;
 
@@ -149,6 +188,9 @@ struct bcmd_msg_buf {
 	size_t offsets_size;
 	size_t buf_size;
 
+	struct fast_slob *slob;		// single-copy: receiver's slob holding the data
+	struct slob_buf *sbuf;
+
 	msg_queue_id owners[0];		// owners of objects in this buffer
 };
 
@@ -157,6 +199,12 @@ struct bcmd_msg_trace {
 	msg_queue_id caller_thread;
 };
 
+struct bcmd_msg_priority {
+	int policy;
+	int rt_priority;
+	long nice;
+};
+
 struct bcmd_msg {
 	struct list_head list;
 
@@ -174,6 +222,12 @@ struct bcmd_msg {
 
 	msg_queue_id reply_to;
 
+	u64 send_time;			// when it was enqueued, in ns
+	u64 call_time;			// replies only: when the transaction being replied was sent
+
+	struct bcmd_msg_priority priority;		// sender's, inherited by the receiver of a call
+	struct bcmd_msg_priority saved_priority;	// receiver's own, restored when it replies
+
 	int trace_depth;
 	struct bcmd_msg_trace traces[MAX_TRACE_DEPTH];
 };
@@ -190,6 +244,14 @@ struct slob_buf {
 static struct binder_obj *context_mgr_obj;	// compat: is context mgr necessary?
 static uid_t context_mgr_uid = -1;
 
+/* copy transaction data from the sender straight into the receiver's slob buffer */
+static int single_copy = 1;
+module_param(single_copy, int, S_IRUGO | S_IWUSR);
+
+/* share of each mmap reserved for buffers that don't fit in their slob size class */
+static int slob_spill_percent = 25;
+module_param(slob_spill_percent, int, S_IRUGO | S_IWUSR);
+
 static struct dentry *debugfs_root;
 
 
@@ -198,104 +260,149 @@ static int debugfs_new_thread(struct binder_proc *proc, struct binder_thread *th
 static int debugfs_new_obj(struct binder_proc *proc, struct binder_obj *obj);
 
 
-// TODO: to be deleted
-void _hexdump(const void *buf, unsigned long size)
+static inline u64 binder_clock(void)
 {
-	int col = 0, off = 0, n = 0;
-	unsigned char *p = (unsigned char *)buf;
-	char cbuf[64];
+	return ktime_to_ns(ktime_get());
+}
 
-	if (size > 256)
-		size = 256;
-	while (size--) {
-		if (!col)
-			printk("\t%08x:", off);
+static inline void binder_lat_record(unsigned long *hist, u64 start, u64 now)
+{
+	int n = (now > start) ? fls64(now - start) : 0;
 
-		printk(" %02x", *p);
-		cbuf[n++] = (*p >= 0x20 && *p < 0x7f) ? (char)*p : ' ';
-		cbuf[n++] = ' ';
+	hist[min(n, LAT_HIST_SIZE - 1)]++;
+}
 
-		p++;
-		off++;
-		col++;
+static inline struct hlist_head *binder_obj_bucket(struct binder_obj_table *table, msg_queue_id owner, void *binder)
+{
+	return &table->buckets[hash_long((unsigned long)binder ^ owner, table->bits)];
+}
 
-		if (!(col % 16)) {
-			cbuf[n] = '\0';
-			printk("    %s\n", cbuf);
-			n = 0;
-			col = 0;
-		} else if (!(col % 4))
-			printk("  ");
+static inline struct binder_obj *binder_obj_entry(struct hlist_node *node, int gen)
+{
+	return container_of(node - gen, struct binder_obj, hash_node[0]);
+}
+
+static struct binder_obj *binder_lookup_obj(struct binder_obj_table *table, msg_queue_id owner, void *binder)
+{
+	struct hlist_node *node;
+	struct binder_obj *obj;
+
+	for (node = rcu_dereference_raw(hlist_first_rcu(binder_obj_bucket(table, owner, binder)));
+	     node; node = rcu_dereference_raw(hlist_next_rcu(node))) {
+		obj = binder_obj_entry(node, table->gen);
+		if (obj->owner == owner && obj->binder == binder)
+			return obj;
 	}
 
-	if (col % 16) {
-		while (col++ < 16) 
-			printk("    ");
-		cbuf[n] = '\0';
-		printk("  %s\n", cbuf);
-	} else
-		printk("\n");
+	return NULL;
 }
 
-void _dump_msg(int pid, int tid, int write, struct bcmd_msg *msg)
+static struct binder_obj_table *binder_alloc_obj_table(struct binder_proc *proc, unsigned int bits, int gen)
 {
-	printk("proc %d (tid %d) %s %s message:\n", pid, tid, write ? "write" : "read", (msg->type == BC_REPLY) ? "reply" : "transaction");
-	printk("\tbinder %p, cookie %p, type %u, code %u, flags %u, uid %d, pid %d, queue %ld\n", 
-		msg->binder, msg->cookie, msg->type, msg->code, msg->flags, msg->sender_pid, msg->sender_euid, msg->reply_to);
+	struct binder_obj_table *table;
+	size_t i, size = sizeof(*table) + (sizeof(struct hlist_head) << bits);
 
-	if (msg->buf) {
-		struct bcmd_msg_buf *mbuf = msg->buf;
+	table = (size > PAGE_SIZE) ? vmalloc(size) : kmalloc(size, GFP_KERNEL);
+	if (!table)
+		return NULL;
 
-		if (mbuf->data_size > 0) {
-			printk("\t data size %u\n", mbuf->data_size);
-			_hexdump(mbuf->data, mbuf->data_size);
+	table->bits = bits;
+	table->gen = gen;
+	table->proc = proc;
+	for (i = 0; i < (1 << bits); i++)
+		INIT_HLIST_HEAD(&table->buckets[i]);
 
-			if (mbuf->offsets_size > 0) {
-				printk("\t offsets size %u\n", mbuf->offsets_size);
-				_hexdump(mbuf->offsets, mbuf->offsets_size);
-			}
-		}
-	}
+	return table;
 }
 
-static inline int binder_cmp(msg_queue_id owner0, void *binder0, msg_queue_id owner1, void *binder1)
+static void binder_free_obj_table(struct binder_obj_table *table)
 {
-	ssize_t sign;
+	if (sizeof(*table) + (sizeof(struct hlist_head) << table->bits) > PAGE_SIZE)
+		vfree(table);
+	else
+		kfree(table);
+}
 
-	if ((sign = owner0 - owner1))
-		return (sign > 0) ? 1 : -1;
+static void binder_retire_obj_table(struct rcu_head *head)
+{
+	struct binder_obj_table *table = container_of(head, struct binder_obj_table, rcu);
 
-	if ((sign = binder0 - binder1))
-		return (sign > 0) ? 1 : -1;
+	ACCESS_ONCE(table->proc->obj_table_retired) = NULL;
+	binder_free_obj_table(table);
+}
 
-	return 0;
+/* vfree() can't be called from the RCU callback, so large tables are retired synchronously */
+static inline void binder_call_retire_obj_table(struct binder_obj_table *table)
+{
+	if (sizeof(*table) + (sizeof(struct hlist_head) << table->bits) > PAGE_SIZE) {
+		synchronize_rcu();
+		binder_retire_obj_table(&table->rcu);
+	} else
+		call_rcu(&table->rcu, binder_retire_obj_table);
 }
 
-static struct binder_obj *binder_find_obj(struct binder_proc *proc, msg_queue_id owner, void *binder)
+// called with proc->obj_lock held
+static struct binder_obj_table *binder_rehash_objs(struct binder_proc *proc, struct binder_obj_table *new_table)
 {
-	struct rb_node **p = &proc->obj_tree.rb_node;
-	struct rb_node *parent = NULL;
+	struct binder_obj_table *table = proc->obj_table;
+	struct hlist_node *node;
 	struct binder_obj *obj;
-	int r;
-
-	spin_lock(&proc->obj_lock);
-	while (*p) {
-		parent = *p;
-		obj = rb_entry(parent, struct binder_obj, rb_node);
+	size_t i;
 
-		r = binder_cmp(owner, binder, obj->owner, obj->binder);
-		if (r < 0)
-			p = &(*p)->rb_left;
-		else if (r > 0)
-			p = &(*p)->rb_right;
-		else {
-			spin_unlock(&proc->obj_lock);
-			return obj;
+	for (i = 0; i < (1 << table->bits); i++) {
+		hlist_for_each(node, &table->buckets[i]) {
+			obj = binder_obj_entry(node, table->gen);
+			hlist_add_head_rcu(&obj->hash_node[new_table->gen],
+				binder_obj_bucket(new_table, obj->owner, obj->binder));
 		}
 	}
+
+	proc->obj_table_retired = table;
+	rcu_assign_pointer(proc->obj_table, new_table);
+	return table;
+}
+
+static void binder_grow_obj_table(struct binder_proc *proc)
+{
+	struct binder_obj_table *table, *new_table, *old_table = NULL;
+	unsigned int bits;
+	int gen;
+
+	rcu_read_lock();
+	table = rcu_dereference(proc->obj_table);
+	bits = table->bits;
+	gen = table->gen;
+	rcu_read_unlock();
+
+	new_table = binder_alloc_obj_table(proc, bits + 1, !gen);
+	if (!new_table)
+		return;
+
+	spin_lock(&proc->obj_lock);
+	table = proc->obj_table;
+	if (table->bits == bits && table->gen == gen && !proc->obj_table_retired &&
+	    proc->obj_count > (2UL << bits))
+		old_table = binder_rehash_objs(proc, new_table);
 	spin_unlock(&proc->obj_lock);
 
-	return NULL;
+	if (old_table)
+		binder_call_retire_obj_table(old_table);
+	else
+		binder_free_obj_table(new_table);
+}
+
+static struct binder_obj *binder_find_obj(struct binder_proc *proc, msg_queue_id owner, void *binder)
+{
+	struct binder_obj *obj;
+
+	rcu_read_lock();
+	obj = binder_lookup_obj(rcu_dereference(proc->obj_table), owner, binder);
+	rcu_read_unlock();
+
+	this_cpu_inc(proc->obj_stats->lookups);
+	if (!obj)
+		this_cpu_inc(proc->obj_stats->misses);
+	return obj;
 }
 
 static inline struct binder_obj *binder_find_my_obj(struct binder_proc *proc, void *binder)
@@ -306,29 +413,22 @@ static inline struct binder_obj *binder_find_my_obj(struct binder_proc *proc, vo
 static struct binder_obj *binder_find_obj_by_ref(struct binder_proc *proc, unsigned long ref)
 {
 	struct binder_obj *obj;
-	struct hlist_head *head;
-	struct hlist_node *node;
 
-	spin_lock(&proc->obj_lock);
+	rcu_read_lock();
+	obj = radix_tree_lookup(&proc->obj_refs, ref);
+	rcu_read_unlock();
 
-	head = &proc->obj_hash[ref % OBJ_HASH_BUCKET_SIZE];
-	hlist_for_each_entry(obj, node, head, hash_node) {
-		if (obj->ref == ref) {
-			spin_unlock(&proc->obj_lock);
-			return obj;
-		}
-	}
-
-	spin_unlock(&proc->obj_lock);
-	return NULL;
+	this_cpu_inc(proc->obj_stats->ref_lookups);
+	if (!obj)
+		this_cpu_inc(proc->obj_stats->misses);
+	return obj;
 }
 
 static struct binder_obj *_binder_new_obj(struct binder_proc *proc, msg_queue_id owner, struct msg_queue *owner_queue, void *binder, void *cookie)
 {
-	struct rb_node **p = &proc->obj_tree.rb_node;
-	struct rb_node *parent = NULL;
+	struct binder_obj_table *table;
 	struct binder_obj *obj, *new_obj;
-	int r;
+	int grow;
 
 	new_obj = kmalloc(sizeof(*obj), GFP_KERNEL);
 	if (!new_obj)
@@ -343,29 +443,37 @@ static struct binder_obj *_binder_new_obj(struct binder_proc *proc, msg_queue_id
 
 	atomic_set(&new_obj->refs, 0);
 
-	spin_lock(&proc->obj_lock);
-	while (*p) {
-		parent = *p;
-		obj = rb_entry(parent, struct binder_obj, rb_node);
-
-		r = binder_cmp(owner, binder, obj->owner, obj->binder);
-		if (r < 0)
-			p = &(*p)->rb_left;
-		else if (r > 0)
-			p = &(*p)->rb_right;
-		else {	// other thread has created an object before we do
-			spin_unlock(&proc->obj_lock);
-			kfree(new_obj);
-			return obj;
-		}
+	if (radix_tree_preload(GFP_KERNEL) < 0) {
+		kfree(new_obj);
+		return NULL;
 	}
 
-	rb_link_node(&new_obj->rb_node, parent, p);
-	rb_insert_color(&new_obj->rb_node, &proc->obj_tree);
+	spin_lock(&proc->obj_lock);
+	table = proc->obj_table;
+
+	obj = binder_lookup_obj(table, owner, binder);
+	if (obj) {	// other thread has created an object before we do
+		spin_unlock(&proc->obj_lock);
+		radix_tree_preload_end();
+		kfree(new_obj);
+		return obj;
+	}
 
 	new_obj->ref = proc->obj_seq++;
-	hlist_add_head(&new_obj->hash_node, &proc->obj_hash[new_obj->ref % OBJ_HASH_BUCKET_SIZE]);
+	if (radix_tree_insert(&proc->obj_refs, new_obj->ref, new_obj) < 0) {
+		spin_unlock(&proc->obj_lock);
+		radix_tree_preload_end();
+		kfree(new_obj);
+		return NULL;
+	}
+	hlist_add_head_rcu(&new_obj->hash_node[table->gen], binder_obj_bucket(table, owner, binder));
+
+	grow = (++proc->obj_count > (2UL << table->bits) && table->bits < OBJ_HASH_MAX_BITS);
 	spin_unlock(&proc->obj_lock);
+	radix_tree_preload_end();
+
+	if (grow)
+		binder_grow_obj_table(proc);
 
 	debugfs_new_obj(proc, new_obj);
 	return new_obj;
@@ -424,6 +532,12 @@ inline int bcmd_write_msg(msg_queue_id id, struct bcmd_msg *msg)
 	return r;
 }
 
+// used by any process holding a reference to the queue, before waiting for an answer
+inline int _bcmd_write_msg_sync(struct msg_queue *q, struct bcmd_msg *msg)
+{
+	return write_msg_queue_sync(q, &msg->list);
+}
+
 // used by the queue owner
 inline int _bcmd_write_msg_head(struct msg_queue *q, struct bcmd_msg *msg)
 {
@@ -467,12 +581,61 @@ static struct bcmd_msg *binder_alloc_msg(size_t data_size, size_t offsets_size)
 	mbuf->data_size = data_size;
 	mbuf->offsets_size = offsets_size;
 	mbuf->buf_size = buf_size;
+	mbuf->slob = NULL;
+	mbuf->sbuf = NULL;
+
+	msg->buf = mbuf;
+	msg->trace_depth = 0;
+	return msg;
+}
+
+/* Allocate a message whose data and offsets live in a buffer reserved from the
+   receiver's slob, so the sender copies the payload from user space only once */
+static struct bcmd_msg *binder_alloc_slob_msg(struct fast_slob *slob, size_t data_size, size_t offsets_size)
+{
+	size_t num_objs, msg_size;
+	struct bcmd_msg *msg;
+	struct bcmd_msg_buf *mbuf;
+	struct slob_buf *sbuf;
+
+	num_objs = offsets_size / sizeof(size_t);
+	msg_size = sizeof(*msg) + sizeof(*mbuf) + num_objs * sizeof(msg_queue_id);
+
+	msg = kmalloc(msg_size, GFP_KERNEL);
+	if (!msg)
+		return NULL;
+
+	sbuf = fast_slob_alloc(slob, sizeof(*sbuf) + MSG_BUF_ALIGN(data_size) + MSG_BUF_ALIGN(offsets_size));
+	if (!sbuf) {
+		kfree(msg);
+		return NULL;
+	}
+	sbuf->uaddr_data = 0;	// not freeable by the receiver until read, see BC_FREE_BUFFER
+
+	mbuf = (struct bcmd_msg_buf *)((char *)msg + sizeof(*msg));
+	mbuf->data = (uint8_t *)sbuf->data;
+	mbuf->offsets = mbuf->data + MSG_BUF_ALIGN(data_size);
+
+	mbuf->data_size = data_size;
+	mbuf->offsets_size = offsets_size;
+	mbuf->buf_size = msg_size;
+	mbuf->slob = slob;
+	mbuf->sbuf = sbuf;
 
 	msg->buf = mbuf;
 	msg->trace_depth = 0;
 	return msg;
 }
 
+static inline void binder_put_slob_buf(struct bcmd_msg_buf *mbuf)
+{
+	if (mbuf->sbuf) {
+		trace_binder_buffer_free(mbuf->sbuf, MSG_BUF_ALIGN(mbuf->data_size) + MSG_BUF_ALIGN(mbuf->offsets_size));
+		fast_slob_free(mbuf->slob, mbuf->sbuf);
+		mbuf->sbuf = NULL;
+	}
+}
+
 static struct bcmd_msg *binder_realloc_msg(struct bcmd_msg *msg, size_t data_size, size_t offsets_size)
 {
 	size_t num_objs, msg_size, msg_buf_size, buf_size;
@@ -489,6 +652,8 @@ static struct bcmd_msg *binder_realloc_msg(struct bcmd_msg *msg, size_t data_siz
 
 		mbuf->data_size = data_size;
 		mbuf->offsets_size = offsets_size;
+		mbuf->slob = NULL;
+		mbuf->sbuf = NULL;
 
 		msg->trace_depth = 0;
 		return msg;
@@ -498,11 +663,34 @@ static struct bcmd_msg *binder_realloc_msg(struct bcmd_msg *msg, size_t data_siz
 	return binder_alloc_msg(data_size, offsets_size);
 }
 
+// used by the queue owner: held back until binder_flush_cmds() delivers all of them at once
+static inline void _bcmd_queue_cmd(struct binder_thread *thread, struct bcmd_msg *msg)
+{
+	list_add_tail(&msg->list, &thread->pending_cmds);
+	thread->num_pending_cmds++;
+}
+
+static int binder_flush_cmds(struct binder_thread *thread)
+{
+	struct bcmd_msg *msg, *next;
+	int r;
+
+	r = write_msg_queue_list(thread->queue, &thread->pending_cmds, thread->num_pending_cmds);
+	if (r < 0) {
+		list_for_each_entry_safe(msg, next, &thread->pending_cmds, list) {
+			list_del(&msg->list);
+			kfree(msg);
+		}
+	}
+
+	thread->num_pending_cmds = 0;
+	return r;
+}
+
 // used by the queue owner
-static inline int _binder_write_cmd(struct msg_queue *q, void *binder, void *cookie, unsigned int cmd)
+static inline int _binder_write_cmd(struct binder_thread *thread, void *binder, void *cookie, unsigned int cmd)
 {
 	struct bcmd_msg *msg; 
-	int r;
 
 	msg = binder_alloc_msg(0, 0);
 	if (!msg)
@@ -512,12 +700,7 @@ static inline int _binder_write_cmd(struct msg_queue *q, void *binder, void *coo
 	msg->binder = binder;
 	msg->cookie = cookie;
 
-	r = _bcmd_write_msg(q, msg);
-	if (r < 0) {
-		kfree(msg);
-		return r;
-	}
-
+	_bcmd_queue_cmd(thread, msg);
 	return 0;
 }
 
@@ -552,7 +735,7 @@ static inline int binder_inform_owner(struct binder_obj *obj, unsigned int cmd)
 static inline void binder_reclaim_obj(struct binder_proc *proc, struct binder_obj *obj)
 {
 	if (atomic_read(&proc->busy_threads) <= 1)
-		kfree(obj);
+		kfree_rcu(obj, rcu);
 	else {
 		spin_lock(&proc->reclaim_lock);
 		list_add(&obj->notifiers, &proc->reclaim_list);	// reuse notifiers entry
@@ -567,7 +750,7 @@ static inline void binder_reclaim_objs(struct binder_proc *proc)
 	spin_lock(&proc->reclaim_lock);
 	list_for_each_entry_safe(obj, next, &proc->reclaim_list, notifiers) {
 		list_del(&obj->notifiers);
-		kfree(obj);
+		kfree_rcu(obj, rcu);
 	}
 	spin_unlock(&proc->reclaim_lock);
 }
@@ -616,11 +799,17 @@ static int _binder_free_obj(struct binder_proc *proc, struct binder_obj *obj)
 	return r;
 }
 
+static inline void _binder_unlink_obj(struct binder_proc *proc, struct binder_obj *obj)
+{
+	hlist_del_rcu(&obj->hash_node[proc->obj_table->gen]);
+	radix_tree_delete(&proc->obj_refs, obj->ref);
+	proc->obj_count--;
+}
+
 static int binder_free_obj(struct binder_proc *proc, struct binder_obj *obj, int force)
 {	
 	spin_lock(&proc->obj_lock);
-	rb_erase(&obj->rb_node, &proc->obj_tree);
-	hlist_del(&obj->hash_node);
+	_binder_unlink_obj(proc, obj);
 	spin_unlock(&proc->obj_lock);
 
 	if (!force)
@@ -635,6 +824,7 @@ static int binder_free_obj(struct binder_proc *proc, struct binder_obj *obj, int
 static int clear_msg_buf(struct binder_proc *proc, struct bcmd_msg *msg)
 {
 	struct bcmd_msg_buf *mbuf = msg->buf;
+	int r = 0;
 
 	if (mbuf->offsets_size > 0) {
 		struct flat_binder_object *bp;
@@ -647,8 +837,10 @@ static int clear_msg_buf(struct binder_proc *proc, struct bcmd_msg *msg)
 
 		while (p < ep) {
 			off = *p++;
-			if (off + sizeof(*bp) > mbuf->data_size)
-				return -EINVAL;
+			if (off + sizeof(*bp) > mbuf->data_size) {
+				r = -EINVAL;
+				break;
+			}
 
 			bp = (struct flat_binder_object *)(mbuf->data + off);
 			switch (bp->type) {
@@ -671,49 +863,53 @@ static int clear_msg_buf(struct binder_proc *proc, struct bcmd_msg *msg)
 		}
 	}
 
-	return 0;
+	binder_put_slob_buf(mbuf);
+	return r;
 }
 
-static void clear_msg_queue(struct binder_proc *proc, struct msg_queue *q)
+/* Drop a message that will never be read, giving back what it holds and failing its sender's
+   wait for a reply. Its memory is either handed on or freed. */
+static void clear_msg(struct binder_proc *proc, struct bcmd_msg *msg)
 {
-	struct list_head *entry;
-	struct bcmd_msg *msg;
-
-	while ((entry = msg_queue_pop(q))) {
-		msg = container_of(entry, struct bcmd_msg, list);
+	if (msg->type == BC_TRANSACTION) {
+		clear_msg_buf(proc, msg);
 
-		if (msg->type == BC_TRANSACTION) {
-			clear_msg_buf(proc, msg);
+		if (!(msg->flags & TF_ONE_WAY)) {
+			msg->type = BR_DEAD_REPLY;
+			if (!bcmd_write_msg(msg->reply_to, msg))
+				return;
+		}
+	} else if (msg->type == BC_REPLY) {
+		clear_msg_buf(proc, msg);
+	} else if (msg->type == BC_CLEAR_DEATH_NOTIFICATION) {
+		struct binder_obj *obj;
 
-			if (!(msg->flags & TF_ONE_WAY)) {
-				msg->type = BR_DEAD_REPLY;
-				if (!bcmd_write_msg(msg->reply_to, msg))
-					continue;
-			}
-		} else if (msg->type == BC_REPLY) {
-			clear_msg_buf(proc, msg);
-		} else if (msg->type == BC_CLEAR_DEATH_NOTIFICATION) {
-			struct binder_obj *obj;
-
-			obj = binder_find_my_obj(proc, msg->binder);
-			if (obj) {
-				struct binder_notifier *notifier, *next;
-
-				spin_lock(&obj->lock);
-				list_for_each_entry_safe(notifier, next, &obj->notifiers, list) {
-					if (notifier->event == BINDER_EVT_OBJ_DEAD &&
-					    notifier->cookie == msg->cookie) {
-						list_del(&notifier->list);
-						kfree(notifier);
-						break;
-					}
+		obj = binder_find_my_obj(proc, msg->binder);
+		if (obj) {
+			struct binder_notifier *notifier, *next;
+
+			spin_lock(&obj->lock);
+			list_for_each_entry_safe(notifier, next, &obj->notifiers, list) {
+				if (notifier->event == BINDER_EVT_OBJ_DEAD &&
+				    notifier->cookie == msg->cookie) {
+					list_del(&notifier->list);
+					kfree(notifier);
+					break;
 				}
-				spin_unlock(&obj->lock);
 			}
+			spin_unlock(&obj->lock);
 		}
-
-		kfree(msg);
 	}
+
+	kfree(msg);
+}
+
+static void clear_msg_queue(struct binder_proc *proc, struct msg_queue *q)
+{
+	struct list_head *entry;
+
+	while ((entry = msg_queue_pop(q)))
+		clear_msg(proc, container_of(entry, struct bcmd_msg, list));
 }
 
 static void thread_queue_release(struct msg_queue *q, void *data)
@@ -746,8 +942,10 @@ static void thread_queue_release(struct msg_queue *q, void *data)
 static void proc_queue_release(struct msg_queue *q, void *data)
 {
 	struct binder_proc *proc = data;
-	struct rb_node *n;
+	struct binder_obj_table *table = proc->obj_table;
+	struct hlist_node *n;
 	struct binder_obj *obj;
+	size_t i;
 
 	if (proc->proc_dir)
 		debugfs_remove_recursive(proc->proc_dir);
@@ -755,35 +953,49 @@ static void proc_queue_release(struct msg_queue *q, void *data)
 	clear_msg_queue(proc, q);
 
 	// safe to free objs and send BR_DEAD_BINDER
-	while ((n = rb_first(&proc->obj_tree))) {
-		obj = rb_entry(n, struct binder_obj, rb_node);
-
-		rb_erase(n, &proc->obj_tree);
-		hlist_del(&obj->hash_node);
+	for (i = 0; i < (1 << table->bits); i++) {
+		while ((n = table->buckets[i].first)) {
+			obj = binder_obj_entry(n, table->gen);
+			_binder_unlink_obj(proc, obj);
 
-		_binder_free_obj(proc, obj);
+			_binder_free_obj(proc, obj);
+		}
 	}
 
 	if (proc->slob)
 		fast_slob_destroy(proc->slob);
 
+	if (ACCESS_ONCE(proc->obj_table_retired))
+		rcu_barrier();
+	binder_free_obj_table(table);
+	free_percpu(proc->obj_stats);
+	free_percpu(proc->lat_stats);
 	kfree(proc);
 }
 
 static struct binder_proc *binder_new_proc(struct file *filp)
 {
 	struct binder_proc *proc;
-	int i;
 
 	proc = kmalloc(sizeof(*proc), GFP_KERNEL);
 	if (!proc)
 		return NULL;
 
+	proc->obj_table = binder_alloc_obj_table(proc, OBJ_HASH_MIN_BITS, 0);
+	if (!proc->obj_table)
+		goto no_table;
+
+	proc->obj_stats = alloc_percpu(struct binder_obj_stats);
+	if (!proc->obj_stats)
+		goto no_stats;
+
+	proc->lat_stats = alloc_percpu(struct binder_lat_stats);
+	if (!proc->lat_stats)
+		goto no_lat_stats;
+
 	proc->queue = create_msg_queue(0, proc_queue_release, proc);
-	if (!proc->queue) {
-		kfree(proc);
-		return NULL;
-	}
+	if (!proc->queue)
+		goto no_queue;
 
 	proc->slob = NULL;
 	proc->slob_uses = 0;
@@ -799,18 +1011,28 @@ static struct binder_proc *binder_new_proc(struct file *filp)
 	spin_lock_init(&proc->lock);
 	proc->thread_tree.rb_node = NULL;
 
-	for (i = 0; i < sizeof(proc->obj_hash) / sizeof(proc->obj_hash[0]); i++)
-		INIT_HLIST_HEAD(&proc->obj_hash[i]);
+	proc->obj_table_retired = NULL;
+	INIT_RADIX_TREE(&proc->obj_refs, GFP_ATOMIC);
 	proc->obj_seq = 1;
+	proc->obj_count = 0;
 
 	spin_lock_init(&proc->obj_lock);
-	proc->obj_tree.rb_node = NULL;
 
 	spin_lock_init(&proc->reclaim_lock);
 	INIT_LIST_HEAD(&proc->reclaim_list);
 
 	debugfs_new_proc(proc);
 	return proc;
+
+no_queue:
+	free_percpu(proc->lat_stats);
+no_lat_stats:
+	free_percpu(proc->obj_stats);
+no_stats:
+	binder_free_obj_table(proc->obj_table);
+no_table:
+	kfree(proc);
+	return NULL;
 }
 
 static struct binder_thread *binder_new_thread(struct binder_proc *proc, struct file *filp, pid_t pid)
@@ -834,6 +1056,8 @@ static struct binder_thread *binder_new_thread(struct binder_proc *proc, struct
 	new_thread->non_block = (filp->f_flags & O_NONBLOCK) ? 1 : 0;	// compat
 	new_thread->pending_replies = 0;
 	INIT_LIST_HEAD(&new_thread->incoming_transactions);
+	new_thread->num_pending_cmds = 0;
+	INIT_LIST_HEAD(&new_thread->pending_cmds);
 	new_thread->proc = proc;
 
 	spin_lock(&proc->lock);
@@ -927,7 +1151,8 @@ static inline int binder_acquire_obj(struct binder_proc *proc, struct binder_thr
 
 		if (OBJ_IS_BINDER(obj)) {
 			msg->type = BR_ACQUIRE;
-			r = _bcmd_write_msg(thread->queue, msg); // owner thread should receive BR_ACQUIRE
+			_bcmd_queue_cmd(thread, msg); // owner thread should receive BR_ACQUIRE
+			r = 0;
 		} else {
 			msg->type = BC_ACQUIRE;
 			r = bcmd_write_msg(obj->owner, msg); // tell the owner we are referencing it
@@ -959,7 +1184,8 @@ static inline int binder_release_obj(struct binder_proc *proc, struct binder_thr
 
 		if (OBJ_IS_BINDER(obj)) {
 			msg->type = BR_RELEASE;
-			r = _bcmd_write_msg(thread->queue, msg);
+			_bcmd_queue_cmd(thread, msg);
+			r = 0;
 		} else {
 			msg->type = BC_RELEASE;
 			r = bcmd_write_msg(obj->owner, msg); // tell the owner we are no longer referencing it
@@ -1194,11 +1420,112 @@ static inline int bcmd_lookup_caller(struct binder_proc *proc, struct binder_thr
 	return 0;
 }
 
+static inline int binder_rt_policy(int policy)
+{
+	return (policy == SCHED_FIFO || policy == SCHED_RR);
+}
+
+static inline void binder_get_priority(struct bcmd_msg_priority *prio)
+{
+	prio->policy = current->policy;
+	prio->rt_priority = current->rt_priority;
+	prio->nice = task_nice(current);
+}
+
+static void binder_set_nice(long nice)
+{
+	long min_nice;
+
+	if (can_nice(current, nice)) {
+		set_user_nice(current, nice);
+		return;
+	}
+
+	// compat: boost as far as RLIMIT_NICE allows, as the original driver does
+	min_nice = 20 - current->signal->rlim[RLIMIT_NICE].rlim_cur;
+	if (min_nice < task_nice(current))
+		set_user_nice(current, min_nice);
+}
+
+/* Run a two-way call at the caller's priority, if that's higher than ours. The caller's priority
+   is whatever it runs at, including what it has inherited itself, so it propagates along nested
+   calls (see bcmd_fill_traces()). Ours is saved in the message, which stays on the incoming
+   transaction stack until we reply, so nested incoming calls are unwound in order. */
+static void binder_inherit_priority(struct bcmd_msg *msg)
+{
+	struct bcmd_msg_priority *prio = &msg->priority;
+	struct sched_param param;
+
+	binder_get_priority(&msg->saved_priority);
+
+	if (binder_rt_policy(prio->policy)) {
+		if (!rt_task(current) || current->rt_priority < prio->rt_priority) {
+			param.sched_priority = prio->rt_priority;
+			sched_setscheduler_nocheck(current, prio->policy, &param);
+		}
+	} else if (!rt_task(current) && prio->nice < task_nice(current))
+		binder_set_nice(prio->nice);
+}
+
+static void binder_restore_priority(struct bcmd_msg *msg)
+{
+	struct bcmd_msg_priority *prio = &msg->saved_priority;
+	struct sched_param param;
+
+	if (current->policy != prio->policy || current->rt_priority != prio->rt_priority) {
+		param.sched_priority = prio->rt_priority;
+		sched_setscheduler_nocheck(current, prio->policy, &param);
+	}
+
+	if (!binder_rt_policy(prio->policy) && task_nice(current) != prio->nice)
+		set_user_nice(current, prio->nice);
+}
+
+static struct binder_proc *binder_queue_proc(struct msg_queue *q)
+{
+	if (q->release == proc_queue_release)
+		return q->private;
+	else if (q->release == thread_queue_release)
+		return ((struct binder_thread *)q->private)->proc;
+	else
+		return NULL;
+}
+
+/* Allocate (or reuse, for replies) the message to be delivered to queue 'q'. When possible the
+   buffer is reserved from the receiving process's slob at this point, instead of being copied
+   there when the message is read. The caller must hold a reference to 'q', which in turn keeps
+   the receiver's slob alive until the message is enqueued. */
+static struct bcmd_msg *binder_alloc_transaction_msg(struct msg_queue *q, struct bcmd_msg *msg, size_t data_size, size_t offsets_size)
+{
+	struct binder_proc *target;
+
+	if (single_copy && data_size > 0) {
+		target = binder_queue_proc(q);
+		if (target && target->slob && target->ustart) {
+			if (msg)
+				kfree(msg);
+
+			msg = binder_alloc_slob_msg(target->slob, data_size, offsets_size);
+			trace_binder_buffer_alloc(msg ? msg->buf->sbuf : NULL,
+				MSG_BUF_ALIGN(data_size) + MSG_BUF_ALIGN(offsets_size));
+			return msg;
+		}
+	}
+
+	if (msg)
+		return binder_realloc_msg(msg, data_size, offsets_size);
+	else
+		return binder_alloc_msg(data_size, offsets_size);
+}
+
 static int bcmd_write_transaction(struct binder_proc *proc, struct binder_thread *thread, struct bcmd_transaction_data *tdata, uint32_t bcmd)
 {
 	struct bcmd_msg *msg;
+	struct msg_queue *to_q;
 	msg_queue_id to_id;
 	void *binder, *cookie;
+	u64 call_time = 0;
+	int r;
 
 	if (bcmd == BC_TRANSACTION) {
 		struct binder_obj *obj;
@@ -1211,15 +1538,21 @@ static int bcmd_write_transaction(struct binder_proc *proc, struct binder_thread
 		if (!obj)
 			goto failed_reply;
 
-		msg = binder_alloc_msg(tdata->data_size, tdata->offsets_size);
-		if (!msg)
+		to_id = obj->owner;
+		if (!(tdata->flags & TF_ONE_WAY))
+			bcmd_lookup_caller(proc, thread, &to_id);
+
+		to_q = get_msg_queue(to_id);
+		if (!to_q)
 			goto failed_reply;
 
-		to_id = obj->owner;
+		msg = binder_alloc_transaction_msg(to_q, NULL, tdata->data_size, tdata->offsets_size);
+		if (!msg)
+			goto failed_queue;
+
 		if (!(tdata->flags & TF_ONE_WAY)) {
 			if (bcmd_fill_traces(proc, thread, msg) < 0)
 				goto failed_msg;
-			bcmd_lookup_caller(proc, thread, &to_id);
 		}
 
 		binder = obj->binder;
@@ -1236,12 +1569,21 @@ static int bcmd_write_transaction(struct binder_proc *proc, struct binder_thread
 		msg = list_first_entry(&thread->incoming_transactions, struct bcmd_msg, list);
 		list_del(&msg->list);
 
+		binder_restore_priority(msg);
+
 		to_id = msg->reply_to;
+		call_time = msg->send_time;
 		binder = cookie = NULL;		// compat
 
-		msg = binder_realloc_msg(msg, tdata->data_size, tdata->offsets_size);
-		if (!msg)
+		to_q = get_msg_queue(to_id);
+		if (!to_q) {
+			kfree(msg);
 			goto failed_reply;
+		}
+
+		msg = binder_alloc_transaction_msg(to_q, msg, tdata->data_size, tdata->offsets_size);
+		if (!msg)
+			goto failed_queue;
 	}
 
 	msg->type = bcmd;
@@ -1252,12 +1594,12 @@ static int bcmd_write_transaction(struct binder_proc *proc, struct binder_thread
 	msg->sender_pid = proc->pid;
 	msg->sender_euid = current->cred->euid;
 	msg->reply_to = msg_queue_id(thread->queue);	// reply queue & indicating source
+	binder_get_priority(&msg->priority);
 
 	if (tdata->data_size > 0) {
 		if (bcmd_write_msg_buf(proc, thread, msg->buf, tdata) < 0)
 			goto failed_msg;
 	}
-	DUMP_MSG(proc->pid, thread->pid, 1, msg);
 
 	/* compat: send BR_TRANSACTION_COMPLETE to the calling thread. It has to be written to the
 	   thread queue after the message ('msg') has been assembled, so that the referencing commands
@@ -1266,11 +1608,32 @@ static int bcmd_write_transaction(struct binder_proc *proc, struct binder_thread
 	   message (of 'msg') arrives earlier before COMPLETE is enqueued, in which case the framework
 	   will simply treat the reply message as the response and return immediately before draining
 	   COMPLETE. The COMPLETE message left behind will then mess up the next transaction. */
-	if (_binder_write_cmd(thread->queue, binder, cookie, BR_TRANSACTION_COMPLETE) < 0)
+	if (_binder_write_cmd(thread, binder, cookie, BR_TRANSACTION_COMPLETE) < 0 ||
+	    binder_flush_cmds(thread) < 0)
 		goto failed_write;
 
-	if (bcmd_write_msg(to_id, msg) < 0)
+	if (bcmd == BC_TRANSACTION) {
+		INST_ENTRY(INST_BINDER_WRITE_TRANSACTION, tdata->code);
+		trace_binder_transaction(proc->pid, thread->pid, to_id, tdata->code, tdata->flags,
+			tdata->data_size, tdata->offsets_size);
+	} else {
+		INST_ENTRY(INST_BINDER_WRITE_REPLY, tdata->data_size);
+		trace_binder_reply(proc->pid, thread->pid, to_id, tdata->code, tdata->flags,
+			tdata->data_size, tdata->offsets_size);
+	}
+
+	msg->call_time = call_time;
+	msg->send_time = binder_clock();
+
+	/* Replies and two-way calls hand the CPU over to the receiver, as we are going back to wait
+	   for the next transaction or for the reply. One-way calls keep the normal wakeup. */
+	if (tdata->flags & TF_ONE_WAY)
+		r = _bcmd_write_msg(to_q, msg);
+	else
+		r = _bcmd_write_msg_sync(to_q, msg);
+	if (r < 0)
 		goto failed_write;
+	put_msg_queue(to_q);
 
 	if (bcmd == BC_TRANSACTION && !(tdata->flags & TF_ONE_WAY))
 		thread->pending_replies++;
@@ -1279,9 +1642,12 @@ static int bcmd_write_transaction(struct binder_proc *proc, struct binder_thread
 failed_write:
 	clear_msg_buf(proc, msg);
 failed_msg:
+	binder_put_slob_buf(msg->buf);
 	kfree(msg);
+failed_queue:
+	put_msg_queue(to_q);
 failed_reply:
-	return _binder_write_cmd(thread->queue, NULL, NULL, BR_FAILED_REPLY);
+	return _binder_write_cmd(thread, NULL, NULL, BR_FAILED_REPLY);
 }
 
 static int bcmd_write_free_buffer(struct binder_proc *proc, struct binder_thread *thread, void *uaddr)
@@ -1299,8 +1665,10 @@ static int bcmd_write_free_buffer(struct binder_proc *proc, struct binder_thread
 	off = (unsigned long)uaddr - proc->ustart - (unsigned long)(((struct slob_buf *)0)->data);
 	sbuf = (struct slob_buf *)(proc->slob->start + off);
 
+	/* Only the kernel writes the header of a live buffer, the area being read-only to user
+	   space, and clearing 'uaddr_data' claims the buffer against racing frees of it */
 	bucket = fast_slob_bucket(proc->slob, sbuf);
-	if (bucket < 0 || (sbuf->uaddr_data != (unsigned long)uaddr)) {
+	if (bucket < 0 || cmpxchg(&sbuf->uaddr_data, (unsigned long)uaddr, 0) != (unsigned long)uaddr) {
 		printk("binder: pid %d (tid %d) trying to free an invalid buffer %p, bucket %d, sbuf %p\n",
 			proc->pid, thread->pid, uaddr, bucket, sbuf);
 		return -EINVAL;
@@ -1311,7 +1679,7 @@ static int bcmd_write_free_buffer(struct binder_proc *proc, struct binder_thread
 		struct binder_obj *obj;
 		size_t *p, *ep;
 
-		off = sbuf->uaddr_offsets - sbuf->uaddr_data;
+		off = sbuf->uaddr_offsets - (unsigned long)uaddr;
 		p = (size_t *)(sbuf->data + off);
 		ep = (size_t *)((char *)p + sbuf->offsets_size);
 		while (p < ep) {
@@ -1329,6 +1697,7 @@ static int bcmd_write_free_buffer(struct binder_proc *proc, struct binder_thread
 		}
 	}
 
+	trace_binder_buffer_free(sbuf, MSG_BUF_ALIGN(sbuf->data_size) + MSG_BUF_ALIGN(sbuf->offsets_size));
 	_fast_slob_free(proc->slob, bucket, sbuf);
 	return 0;
 }
@@ -1555,7 +1924,9 @@ static long bcmd_read_transaction(struct binder_proc *proc, struct binder_thread
 	struct bcmd_msg *msg = *pmsg;
 	struct bcmd_msg_buf *mbuf = msg->buf;
 	uint32_t cmd = (msg->type == BC_TRANSACTION) ? BR_TRANSACTION : BR_REPLY;
+	struct binder_lat_stats *lat;
 	size_t data_size;
+	u64 now;
 	int r;
 
 	if (sizeof(cmd) + sizeof(tdata) > size)
@@ -1574,22 +1945,31 @@ static long bcmd_read_transaction(struct binder_proc *proc, struct binder_thread
 	data_size = MSG_BUF_ALIGN(mbuf->data_size) + MSG_BUF_ALIGN(mbuf->offsets_size);
 	if (data_size > 0) {
 		struct slob_buf *sbuf;
+		unsigned long uaddr;
+
+		if (!proc->slob || !proc->ustart) {
+			binder_put_slob_buf(mbuf);
+			return -ENOMEM;
+		}
 
-		if (proc->slob && proc->ustart) {
+		if (mbuf->sbuf)		// single-copy: the sender has filled in our buffer already
+			sbuf = mbuf->sbuf;
+		else {
 			sbuf = fast_slob_alloc(proc->slob, sizeof(*sbuf) + data_size);
+			trace_binder_buffer_alloc(sbuf, data_size);
 			if (!sbuf) {
 				printk("binder: pid %d (tid %d) failed to allocate transaction data (%u)\n",
 					proc->pid, thread->pid, data_size);
 				return -ENOMEM;
 			}
-		} else
-			return -ENOMEM;
+			sbuf->uaddr_data = 0;
+		}
 
 		sbuf->data_size = mbuf->data_size;
 		sbuf->offsets_size = mbuf->offsets_size;
 
-		sbuf->uaddr_data = proc->ustart + (sbuf->data - proc->slob->start);
-		tdata.data.ptr.buffer = (void *)sbuf->uaddr_data;
+		uaddr = proc->ustart + (sbuf->data - proc->slob->start);
+		tdata.data.ptr.buffer = (void *)uaddr;
 
 		if (mbuf->offsets_size > 0) {
 			size_t *p, *ep;
@@ -1603,23 +1983,45 @@ static long bcmd_read_transaction(struct binder_proc *proc, struct binder_thread
 				bp = (struct flat_binder_object *)(mbuf->data + *p++);
 
 				r = bcmd_read_flat_obj(proc, thread, bp, mbuf->owners[n++]);
-				if (r < 0)
+				if (r < 0) {
+					if (sbuf != mbuf->sbuf)
+						fast_slob_free(proc->slob, sbuf);
+					binder_put_slob_buf(mbuf);
 					return r;
+				}
 			}
 
-			sbuf->uaddr_offsets = sbuf->uaddr_data + (mbuf->offsets - mbuf->data);
+			sbuf->uaddr_offsets = uaddr + (mbuf->offsets - mbuf->data);
 		} else
 			sbuf->uaddr_offsets = 0;
 		tdata.data.ptr.offsets = (void *)sbuf->uaddr_offsets;
 
-		memcpy(sbuf->data, mbuf->data, data_size);
+		if (mbuf->sbuf)
+			mbuf->sbuf = NULL;
+		else
+			memcpy(sbuf->data, mbuf->data, data_size);
+
+		// owned by user space from now on, and only from now on, see BC_FREE_BUFFER
+		smp_wmb();
+		sbuf->uaddr_data = uaddr;
 	} else
 		tdata.data.ptr.buffer = tdata.data.ptr.offsets = NULL;
 
 	if (put_user(cmd, (uint32_t *)buf) ||
 	    copy_to_user(buf + sizeof(cmd), &tdata, sizeof(tdata)))
 		return -EFAULT;
-	DUMP_MSG(proc->pid, thread->pid, 0, msg);
+
+	INST_ENTRY((msg->type == BC_REPLY) ? INST_BINDER_READ_REPLY : INST_BINDER_READ_TRANSACTION, msg->code);
+
+	now = binder_clock();
+	trace_binder_transaction_received(proc->pid, thread->pid, msg->sender_pid, msg->type == BC_REPLY,
+		msg->code, mbuf->data_size, now - msg->send_time);
+
+	lat = get_cpu_ptr(proc->lat_stats);
+	binder_lat_record(lat->queue, msg->send_time, now);
+	if (msg->type == BC_REPLY && msg->call_time)
+		binder_lat_record(lat->call, msg->call_time, now);
+	put_cpu_ptr(proc->lat_stats);
 
 	if (msg->type == BC_TRANSACTION) {
 		if (!(msg->flags & TF_ONE_WAY)) {
@@ -1631,6 +2033,7 @@ static long bcmd_read_transaction(struct binder_proc *proc, struct binder_thread
 			   It appears that it has to follow a strict FILO order, and requires the application
 			   to follow the same order. Because there's no strict sequencing or alike to enforce
 			   the order, things can easily go wrong. */
+			binder_inherit_priority(msg);
 			list_add(&msg->list, &thread->incoming_transactions);
 			msg = NULL;
 		}
@@ -1844,12 +2247,14 @@ static int bcmd_spawn_on_busy(struct binder_proc *proc, struct binder_thread *th
 
 static long binder_thread_read(struct binder_proc *proc, struct binder_thread *thread, char __user *buf, char __user *end)
 {
-	struct msg_queue *q;
-	struct bcmd_msg *msg = NULL;
+	struct msg_queue *q = NULL;
+	struct bcmd_msg *msg = NULL, *next;
+	LIST_HEAD(batch);
+	size_t batch_size = 0;
 	char __user *p = buf;
 	ssize_t size = end - buf;
-	int proc_looper = 0, force_return = 0;
-	long n;
+	int proc_looper = 0, force_return = 0, blocked = 0;
+	long n = 0;
 
 	if (thread->state & BINDER_LOOPER_STATE_READY) {	// compat: only ready threads can request spawn
 		n = bcmd_spawn_on_busy(proc, thread, p, size);
@@ -1858,27 +2263,51 @@ static long binder_thread_read(struct binder_proc *proc, struct binder_thread *t
 	}
 
 	while (size >= sizeof(uint32_t) && !force_return) {
-		if (thread->pending_replies > 0 || !msg_queue_empty(thread->queue))
-			q = thread->queue;
-		else {
-			q = proc->queue;
+		if (!batch_size) {
+			/* drain whatever is available to us, but don't wait for more once
+			   there's something to return */
+			if (p > buf && msg_queue_empty(thread->queue))
+				break;
 
-			proc_looper = 1;
-			atomic_inc(&proc->proc_loopers);
-		}
+			/* Commands on the thread queue are all ours, so take as many as we can
+			   under one lock hold. Transactions on the process queue are taken one
+			   at a time, so that other looper threads can pick up the rest. */
+			if (thread->pending_replies > 0 || !msg_queue_empty(thread->queue))
+				q = thread->queue;
+			else {
+				q = proc->queue;
 
-		if (msg_queue_empty(q) && thread->non_block)
-			break;
+				proc_looper = 1;
+				atomic_inc(&proc->proc_loopers);
+			}
 
-		n = _bcmd_read_msg(q, &msg);
-		if (n < 0)
-			goto clean_up;
+			if (msg_queue_empty(q) && thread->non_block)
+				break;
+
+			if (msg_queue_empty(q)) {
+				INST_ENTRY(INST_BINDER_READ_BLOCK, q == thread->queue);
+				blocked = 1;
+			}
 
-		if (proc_looper) {
-			atomic_dec(&proc->proc_loopers);
-			proc_looper = 0;
+			n = read_msg_queue_list(q, &batch, (q == thread->queue) ? READ_BATCH_SIZE : 1);
+			if (blocked) {
+				INST_ENTRY(INST_BINDER_READ_WAKEUP, n);
+				blocked = 0;
+			}
+			if (n < 0)
+				goto clean_up;
+			batch_size = n;
+
+			if (proc_looper) {
+				atomic_dec(&proc->proc_loopers);
+				proc_looper = 0;
+			}
 		}
 
+		msg = list_first_entry(&batch, struct bcmd_msg, list);
+		list_del(&msg->list);
+		batch_size--;
+
 		switch (msg->type) {
 			case BC_TRANSACTION:
 			case BC_REPLY:
@@ -1888,7 +2317,6 @@ static long binder_thread_read(struct binder_proc *proc, struct binder_thread *t
 
 			case BR_TRANSACTION_COMPLETE:
 				n = bcmd_read_transaction_complete(proc, thread, &msg, p, size);
-				force_return = 1;
 				break;
 
 			case BC_ACQUIRE:
@@ -1896,16 +2324,12 @@ static long binder_thread_read(struct binder_proc *proc, struct binder_thread *t
 			case BR_ACQUIRE:
 			case BR_RELEASE:
 				n = bcmd_read_acquire(proc, thread, &msg, p, size);
-				if (n > 0)
-					force_return = 1;
 				break;
 
 			case BC_REQUEST_DEATH_NOTIFICATION:
 			case BC_CLEAR_DEATH_NOTIFICATION:
 			case BR_CLEAR_DEATH_NOTIFICATION_DONE:
 				n = bcmd_read_notifier(proc, thread, &msg, p, size);
-				if (n > 0)
-					force_return = 1;
 				break;
 
 			case BR_DEAD_BINDER:
@@ -1936,11 +2360,8 @@ static long binder_thread_read(struct binder_proc *proc, struct binder_thread *t
 				if (msg) {	// put msg back to the queue
 					printk("binder: proc %d (tid %d): not enough read space, put message back\n",
 						proc->pid, thread->pid);
-					n = _bcmd_write_msg_head(q, msg);
-					if (n < 0) {
-						kfree(msg);
-						goto clean_up;
-					}
+					list_add(&msg->list, &batch);
+					batch_size++;
 				}
 				n = 0;		// TODO: review no-space handling
 			}
@@ -1952,6 +2373,15 @@ clean_up:
 	if (proc_looper)
 		atomic_dec(&proc->proc_loopers);
 
+	/* return what we've taken off but not consumed to the front of the queue, in order, or
+	   if the queue has gone away in the meantime, release them as its release would have */
+	if (batch_size > 0 && write_msg_queue_list_head(q, &batch, batch_size) < 0) {
+		list_for_each_entry_safe(msg, next, &batch, list) {
+			list_del(&msg->list);
+			clear_msg(proc, msg);
+		}
+	}
+
 	if (n < 0)
 		return n;
 	else
@@ -1960,14 +2390,19 @@ clean_up:
 
 static inline int cmd_write_read(struct binder_proc *proc, struct binder_thread *thread, struct binder_write_read *bwr)
 {
-	int r;
+	int r, f;
 
 	if (bwr->write_size > 0 && bwr->write_consumed < bwr->write_size) {
 		r = binder_thread_write(proc, thread, 
 					(char __user *)bwr->write_buffer + bwr->write_consumed,
 					(char __user *)bwr->write_buffer + bwr->write_size);
+
+		/* deliver the commands to ourselves generated by the write in one go */
+		f = binder_flush_cmds(thread);
 		if (r < 0)
 			return r;
+		if (f < 0)
+			return f;
 		bwr->write_consumed += r;
 	}
 
@@ -2161,6 +2596,7 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 {
 	struct binder_proc *proc = filp->private_data;
 	size_t size = vma->vm_end - vma->vm_start;
+	size_t spill_size;
 	int r;
 
 	if (size > 4096 * 1024)		// compat
@@ -2168,15 +2604,18 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 
 	if (vma->vm_flags & VM_WRITE)
 		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
 
 	if (proc->ustart || proc->slob)	// TODO: free existing slob?
 		return -EBUSY;
 
+	spill_size = (slob_spill_percent > 0 && slob_spill_percent < 100) ? PAGE_ALIGN(size * slob_spill_percent / 100) : 0;
+
 	/* compat: sericemanager has a map size of 128K and the rest uses (1024-8)k */
 	if (size < 512 * 1024)
-		proc->slob = fast_slob_create(size, 16 * 1024, 4, 2);
+		proc->slob = fast_slob_create(size, 16 * 1024, 4, 2, spill_size);
 	else
-		proc->slob = fast_slob_create(size, 128 * 1024, 3, 4);
+		proc->slob = fast_slob_create(size, 128 * 1024, 3, 4, spill_size);
 	if (!proc->slob)
 		return -ENOMEM;
 
@@ -2195,6 +2634,52 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 	return 0;
 }
 
+#define CHAIN_HIST_SIZE		8
+
+static void debugfs_obj_stats(struct seq_file *seq, struct binder_proc *proc)
+{
+	struct binder_obj_table *table;
+	struct binder_obj_stats *stats;
+	unsigned long lookups = 0, ref_lookups = 0, misses = 0;
+	unsigned long hist[CHAIN_HIST_SIZE + 1], len, max_len = 0;
+	struct hlist_node *node;
+	size_t i;
+	int cpu;
+
+	memset(hist, 0, sizeof(hist));
+
+	spin_lock(&proc->obj_lock);
+	table = proc->obj_table;
+	for (i = 0; i < (1 << table->bits); i++) {
+		len = 0;
+		hlist_for_each(node, &table->buckets[i])
+			len++;
+
+		hist[min_t(unsigned long, len, CHAIN_HIST_SIZE)]++;
+		if (len > max_len)
+			max_len = len;
+	}
+	seq_printf(seq, "obj_count: %lu\n", proc->obj_count);
+	seq_printf(seq, "obj_hash_buckets: %u\n", 1 << table->bits);
+	spin_unlock(&proc->obj_lock);
+
+	seq_printf(seq, "obj_hash_max_chain: %lu\n", max_len);
+	seq_printf(seq, "obj_hash_chains (length 0-%d, %d+):", CHAIN_HIST_SIZE - 1, CHAIN_HIST_SIZE);
+	for (i = 0; i <= CHAIN_HIST_SIZE; i++)
+		seq_printf(seq, " %lu", hist[i]);
+	seq_printf(seq, "\n");
+
+	for_each_possible_cpu(cpu) {
+		stats = per_cpu_ptr(proc->obj_stats, cpu);
+		lookups += stats->lookups;
+		ref_lookups += stats->ref_lookups;
+		misses += stats->misses;
+	}
+	seq_printf(seq, "obj_lookups: %lu\n", lookups);
+	seq_printf(seq, "obj_ref_lookups: %lu\n", ref_lookups);
+	seq_printf(seq, "obj_lookup_misses: %lu\n", misses);
+}
+
 static int debugfs_proc_info(struct seq_file *seq, void *start)
 {	
 	struct binder_proc *proc = seq->private;
@@ -2202,11 +2687,65 @@ static int debugfs_proc_info(struct seq_file *seq, void *start)
 	seq_printf(seq, "pid: %d\n", proc->pid);
 	seq_printf(seq, "queue: %p\n", proc->queue);
 	seq_printf(seq, "obj_seq: %lu\n", proc->obj_seq);
+	debugfs_obj_stats(seq, proc);
 	seq_printf(seq, "max_threads: %d\n", proc->max_threads);
 	seq_printf(seq, "registered_loopers: %d\n", atomic_read(&proc->registered_loopers));
 	seq_printf(seq, "proc_loopers: %d\n", atomic_read(&proc->proc_loopers));
 	seq_printf(seq, "requested_loopers: %d\n", atomic_read(&proc->requested_loopers));
 
+	if (proc->slob) {
+		struct fast_slob *slob = proc->slob;
+		struct fast_slob_list *list;
+		int i;
+
+		for (i = 0; i < slob->num_buckets; i++) {
+			list = slob->buckets + i;
+			seq_printf(seq, "slob bucket %d: size %zu, total %zu, used %d, hwm %d\n",
+				i, list->alloc_size, list->num, atomic_read(&list->used), list->hwm);
+		}
+
+		if (slob->spill)
+			seq_printf(seq, "slob spill: size %zu, used %d, hwm %d, allocs %d\n",
+				gen_pool_size(slob->spill), atomic_read(&slob->spill_used),
+				slob->spill_hwm, atomic_read(&slob->spill_allocs));
+		seq_printf(seq, "slob failures: %d\n", atomic_read(&slob->failures));
+	}
+
+	return 0;
+}
+
+static void debugfs_lat_hist(struct seq_file *seq, struct binder_proc *proc, const char *name, size_t off)
+{
+	unsigned long hist[LAT_HIST_SIZE];
+	int cpu, i;
+
+	memset(hist, 0, sizeof(hist));
+	for_each_possible_cpu(cpu) {
+		unsigned long *h = (unsigned long *)((char *)per_cpu_ptr(proc->lat_stats, cpu) + off);
+
+		for (i = 0; i < LAT_HIST_SIZE; i++)
+			hist[i] += h[i];
+	}
+
+	seq_printf(seq, "%s:\n", name);
+	for (i = 0; i < LAT_HIST_SIZE; i++) {
+		if (!hist[i])
+			continue;
+
+		if (i < LAT_HIST_SIZE - 1)
+			seq_printf(seq, "  < %llu ns: %lu\n", 1ULL << i, hist[i]);
+		else
+			seq_printf(seq, " >= %llu ns: %lu\n", 1ULL << (i - 1), hist[i]);
+	}
+}
+
+static int debugfs_proc_latency(struct seq_file *seq, void *start)
+{
+	struct binder_proc *proc = seq->private;
+
+	debugfs_lat_hist(seq, proc, "queue", offsetof(struct binder_lat_stats, queue));
+	debugfs_lat_hist(seq, proc, "call", offsetof(struct binder_lat_stats, call));
+
 	return 0;
 }
 
@@ -2242,6 +2781,11 @@ static int debugfs_proc_open(struct inode *inode, struct file *file)
 	return single_open(file, debugfs_proc_info, inode->i_private);
 }
 
+static int debugfs_latency_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, debugfs_proc_latency, inode->i_private);
+}
+
 static int debugfs_thread_open(struct inode *inode, struct file *file)
 {
 	return single_open(file, debugfs_thread_info, inode->i_private);
@@ -2260,6 +2804,14 @@ static const struct file_operations debugfs_proc_fops = {
 	.release	= single_release
 };
 
+static const struct file_operations debugfs_latency_fops = {
+	.owner		= THIS_MODULE,
+	.open		= debugfs_latency_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release
+};
+
 static const struct file_operations debugfs_thread_fops = {
 	.owner		= THIS_MODULE,
 	.open		= debugfs_thread_open,
@@ -2298,6 +2850,10 @@ static inline int debugfs_new_proc(struct binder_proc *proc)
 		goto no_objs;
 
 	d = debugfs_create_file("info", S_IRUGO, proc->proc_dir, proc, &debugfs_proc_fops);
+	if (!d)
+		goto no_info;
+
+	d = debugfs_create_file("latency", S_IRUGO, proc->proc_dir, proc, &debugfs_latency_fops);
 	if (!d)
 		goto no_info;
 	return 0;
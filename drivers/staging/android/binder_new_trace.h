@@ -0,0 +1,136 @@
+/*
+ * binder_new_trace.h: tracepoints of the Android Binder IPC driver
+ * Copyright (c) 2012 Rong Shen <rong1129@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM binder
+
+#if !defined(_BINDER_NEW_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _BINDER_NEW_TRACE_H
+
+#include <linux/tracepoint.h>
+
+
+DECLARE_EVENT_CLASS(binder_transaction_class,
+	TP_PROTO(pid_t pid, pid_t tid, unsigned long to, unsigned int code, unsigned int flags,
+		 size_t data_size, size_t offsets_size),
+	TP_ARGS(pid, tid, to, code, flags, data_size, offsets_size),
+
+	TP_STRUCT__entry(
+		__field(pid_t, pid)
+		__field(pid_t, tid)
+		__field(unsigned long, to)
+		__field(unsigned int, code)
+		__field(unsigned int, flags)
+		__field(size_t, data_size)
+		__field(size_t, offsets_size)
+	),
+
+	TP_fast_assign(
+		__entry->pid = pid;
+		__entry->tid = tid;
+		__entry->to = to;
+		__entry->code = code;
+		__entry->flags = flags;
+		__entry->data_size = data_size;
+		__entry->offsets_size = offsets_size;
+	),
+
+	TP_printk("pid=%d tid=%d to_queue=%lu code=0x%x flags=0x%x data_size=%zu offsets_size=%zu",
+		__entry->pid, __entry->tid, __entry->to, __entry->code, __entry->flags,
+		__entry->data_size, __entry->offsets_size)
+);
+
+DEFINE_EVENT(binder_transaction_class, binder_transaction,
+	TP_PROTO(pid_t pid, pid_t tid, unsigned long to, unsigned int code, unsigned int flags,
+		 size_t data_size, size_t offsets_size),
+	TP_ARGS(pid, tid, to, code, flags, data_size, offsets_size)
+);
+
+DEFINE_EVENT(binder_transaction_class, binder_reply,
+	TP_PROTO(pid_t pid, pid_t tid, unsigned long to, unsigned int code, unsigned int flags,
+		 size_t data_size, size_t offsets_size),
+	TP_ARGS(pid, tid, to, code, flags, data_size, offsets_size)
+);
+
+TRACE_EVENT(binder_transaction_received,
+	TP_PROTO(pid_t pid, pid_t tid, pid_t sender_pid, int reply, unsigned int code,
+		 size_t data_size, u64 queue_ns),
+	TP_ARGS(pid, tid, sender_pid, reply, code, data_size, queue_ns),
+
+	TP_STRUCT__entry(
+		__field(pid_t, pid)
+		__field(pid_t, tid)
+		__field(pid_t, sender_pid)
+		__field(int, reply)
+		__field(unsigned int, code)
+		__field(size_t, data_size)
+		__field(u64, queue_ns)
+	),
+
+	TP_fast_assign(
+		__entry->pid = pid;
+		__entry->tid = tid;
+		__entry->sender_pid = sender_pid;
+		__entry->reply = reply;
+		__entry->code = code;
+		__entry->data_size = data_size;
+		__entry->queue_ns = queue_ns;
+	),
+
+	TP_printk("pid=%d tid=%d %s from pid=%d code=0x%x data_size=%zu queued=%lluns",
+		__entry->pid, __entry->tid, __entry->reply ? "reply" : "transaction",
+		__entry->sender_pid, __entry->code, __entry->data_size,
+		(unsigned long long)__entry->queue_ns)
+);
+
+/* Buffers in a receiving process's slob, the current task being the one allocating or freeing */
+DECLARE_EVENT_CLASS(binder_buffer_class,
+	TP_PROTO(void *buf, size_t size),
+	TP_ARGS(buf, size),
+
+	TP_STRUCT__entry(
+		__field(void *, buf)
+		__field(size_t, size)
+	),
+
+	TP_fast_assign(
+		__entry->buf = buf;
+		__entry->size = size;
+	),
+
+	TP_printk("buf=%p size=%zu", __entry->buf, __entry->size)
+);
+
+/* 'buf' is NULL if the allocation failed */
+DEFINE_EVENT(binder_buffer_class, binder_buffer_alloc,
+	TP_PROTO(void *buf, size_t size),
+	TP_ARGS(buf, size)
+);
+
+DEFINE_EVENT(binder_buffer_class, binder_buffer_free,
+	TP_PROTO(void *buf, size_t size),
+	TP_ARGS(buf, size)
+);
+
+#endif /* _BINDER_NEW_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH ../../drivers/staging/android
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE binder_new_trace
+
+#include <trace/define_trace.h>
@@ -1,5 +1,5 @@
 /*
- * fast_slob.h: a simple but fast linked-list based buffer allocator
+ * fast_slob.h: a simple but fast lock-free linked-list based buffer allocator
  * Copyright (c) 2012 Rong Shen <rong1129@gmail.com>
  *
  * This program is free software; you can redistribute it and/or modify
@@ -19,43 +19,98 @@
 #define _FAST_SLOB_H
 
 #include <linux/kernel.h>
-#include <linux/spinlock.h>
 #include <linux/slab.h>
 #include <linux/vmalloc.h>
+#include <linux/bitops.h>
 #include <linux/cache.h>
+#include <linux/genalloc.h>
+#include <asm/atomic.h>
+#include <asm/system.h>
 
 
 #define MIN_ALLOC_SIZE		sizeof(char *)
+#define SPILL_ALLOC_ORDER	L1_CACHE_SHIFT
 
 
-struct fast_slob {
-	spinlock_t lock;
+/* Each bucket keeps its free buffers on a lock-free (Treiber) stack. Buffers are addressed by
+   their index within the bucket, so the head packs "index + 1" (0 meaning empty) in the low
+   'idx_bits' bits and a generation tag in the rest. The tag is bumped on every push and pop,
+   which protects the cmpxchg against ABA when a buffer is popped and pushed back while another
+   CPU is still looking at it. The free link stored in each buffer is encoded the same way. */
+struct fast_slob_list {
+	unsigned long head;
+
+	char *start;
+	size_t alloc_size;
+	size_t num;
+
+	atomic_t used;
+	int hwm;			// racy, statistics only
+} ____cacheline_aligned_in_smp;
 
+
+struct fast_slob {
 	size_t bucket_size;
 	int min_alloc_size;
 	int max_alloc_size;
 	int alloc_size_shift;
 	int num_buckets;
 
+	int idx_bits;
+	unsigned long idx_mask;
+
 	char *start, *end;
 
-	char *buckets[0];
+	/* When a size class and every larger one run dry, buffers are carved out of a reserved
+	   'spill' region at the end of the area by a general purpose (lock-free bitmap) range
+	   allocator. The area is mapped to user space and holds data written by other processes,
+	   so the extent of each spill buffer is kept here instead, one bit per SPILL_ALLOC_ORDER
+	   granule: 'spill_starts' marks the first granule of each buffer, 'spill_ends' its last. */
+	struct gen_pool *spill;
+	char *spill_start;
+	unsigned long *spill_starts, *spill_ends;
+	size_t spill_granules;
+	atomic_t spill_used, spill_allocs, failures;
+	int spill_hwm;			// racy, statistics only
+
+	struct fast_slob_list buckets[0];
 };
 
 
-static inline struct fast_slob *fast_slob_create(size_t size, int max_alloc_size, int alloc_size_shift, int num_buckets)
+static inline void fast_slob_spill_reset(struct gen_pool *pool, struct gen_pool_chunk *chunk, void *data)
+{
+	bitmap_zero(chunk->bits, (chunk->end_addr - chunk->start_addr) >> pool->min_alloc_order);
+}
+
+static inline void fast_slob_destroy(struct fast_slob *slob)
+{
+	if (slob->spill) {
+		// buffers still held by user space are reclaimed along with the area
+		gen_pool_for_each_chunk(slob->spill, fast_slob_spill_reset, NULL);
+		gen_pool_destroy(slob->spill);
+	}
+
+	kfree(slob->spill_starts);
+	kfree(slob->spill_ends);
+	vfree(slob->start);
+	kfree(slob);
+}
+
+/* 'spill_size' bytes at the end of the area are set aside for allocations that can't be
+   served by their own or any larger bucket, the rest is divided evenly among the buckets */
+static inline struct fast_slob *fast_slob_create(size_t size, int max_alloc_size, int alloc_size_shift, int num_buckets, size_t spill_size)
 {
 	struct fast_slob *slob;
-	size_t bucket_size, min_alloc_size;
-	char *start, *end, *buf;
+	struct fast_slob_list *list;
+	size_t bucket_size, min_alloc_size, n, num;
 	int i;
 
-	if (max_alloc_size < MIN_ALLOC_SIZE || alloc_size_shift < 1 || num_buckets < 1)
+	if (max_alloc_size < MIN_ALLOC_SIZE || alloc_size_shift < 1 || num_buckets < 1 || spill_size >= size)
 		return NULL;
 
-	bucket_size = L1_CACHE_ALIGN(size / num_buckets);
-	if (bucket_size * num_buckets > size)
-		bucket_size = (size / num_buckets) & ~(L1_CACHE_BYTES - 1);
+	bucket_size = L1_CACHE_ALIGN((size - spill_size) / num_buckets);
+	if (bucket_size * num_buckets > size - spill_size)
+		bucket_size = ((size - spill_size) / num_buckets) & ~(L1_CACHE_BYTES - 1);
 	if (bucket_size < max_alloc_size)
 		return NULL;
 
@@ -63,7 +118,7 @@ static inline struct fast_slob *fast_slob_create(size_t size, int max_alloc_size
 	if (min_alloc_size < MIN_ALLOC_SIZE)
 		return NULL;
 
-	slob = kmalloc(sizeof(*slob) + num_buckets * sizeof(char *), GFP_KERNEL);
+	slob = kmalloc(sizeof(*slob) + num_buckets * sizeof(struct fast_slob_list), GFP_KERNEL);
 	if (!slob)
 		return NULL;
 
@@ -80,48 +135,190 @@ static inline struct fast_slob *fast_slob_create(size_t size, int max_alloc_size
 	slob->alloc_size_shift = alloc_size_shift;
 	slob->num_buckets = num_buckets;
 
-	for (i = 0; i < num_buckets; i++) {
-		start = slob->start + i * bucket_size;
-		end = start + bucket_size;
-		slob->buckets[i] = start;
-
-		while (start < end) {
-			buf = start;
-			start += ALIGN(min_alloc_size, MIN_ALLOC_SIZE);
-			*(char **)buf = (start < end) ? start : NULL;
+	slob->spill = NULL;
+	slob->spill_start = slob->start + num_buckets * bucket_size;
+	slob->spill_starts = slob->spill_ends = NULL;
+	slob->spill_granules = (slob->end - slob->spill_start) >> SPILL_ALLOC_ORDER;
+	slob->spill_hwm = 0;
+	atomic_set(&slob->spill_used, 0);
+	atomic_set(&slob->spill_allocs, 0);
+	atomic_set(&slob->failures, 0);
+
+	if (spill_size > 0) {
+		n = BITS_TO_LONGS(slob->spill_granules) * sizeof(long);
+		slob->spill_starts = kzalloc(n, GFP_KERNEL);
+		slob->spill_ends = kzalloc(n, GFP_KERNEL);
+		slob->spill = gen_pool_create(SPILL_ALLOC_ORDER, -1);
+		if (!slob->spill_starts || !slob->spill_ends || !slob->spill ||
+		    gen_pool_add(slob->spill, (unsigned long)slob->spill_start, slob->end - slob->spill_start, -1) < 0) {
+			fast_slob_destroy(slob);
+			return NULL;
 		}
+	}
+
+	// the smallest buffers are the most numerous, and leave the most bits for the tag
+	slob->idx_bits = fls_long(bucket_size / ALIGN(min_alloc_size, MIN_ALLOC_SIZE));
+	if (slob->idx_bits > BITS_PER_LONG / 2) {
+		fast_slob_destroy(slob);
+		return NULL;
+	}
+	slob->idx_mask = (1UL << slob->idx_bits) - 1;
+
+	for (i = 0; i < num_buckets; i++) {
+		list = slob->buckets + i;
+		list->start = slob->start + i * bucket_size;
+		list->alloc_size = ALIGN(min_alloc_size, MIN_ALLOC_SIZE);
+
+		num = bucket_size / list->alloc_size;
+		for (n = 0; n < num; n++)
+			*(unsigned long *)(list->start + n * list->alloc_size) = (n + 1 < num) ? n + 2 : 0;
+		list->head = num ? 1 : 0;
+		list->num = num;
+
+		atomic_set(&list->used, 0);
+		list->hwm = 0;
 
 		min_alloc_size <<= alloc_size_shift;
 	}
 
-	spin_lock_init(&slob->lock);
+	smp_wmb();
 	return slob;
 }
 
-static inline void fast_slob_destroy(struct fast_slob *slob)
+static inline unsigned long fast_slob_next_head(struct fast_slob *slob, unsigned long old, unsigned long idx)
 {
-	vfree(slob->start);
-	kfree(slob);
+	return ((((old >> slob->idx_bits) + 1) << slob->idx_bits) | idx);
+}
+
+static inline void *fast_slob_pop(struct fast_slob *slob, struct fast_slob_list *list)
+{
+	unsigned long old, new, idx, next;
+	char *p;
+
+	do {
+		old = ACCESS_ONCE(list->head);
+		idx = old & slob->idx_mask;
+		/* a link out of range can only come from a corrupted buffer, end the list there */
+		if (!idx || idx > list->num)
+			return NULL;
+
+		/* the buffer may be popped and handed out by another CPU in the meantime, in which
+		   case the link read here is garbage, but the tag makes the cmpxchg below fail */
+		p = list->start + (idx - 1) * list->alloc_size;
+		smp_read_barrier_depends();
+		next = ACCESS_ONCE(*(unsigned long *)p) & slob->idx_mask;
+		if (next > list->num)
+			next = 0;
+		new = fast_slob_next_head(slob, old, next);
+	} while (cmpxchg(&list->head, old, new) != old);
+
+	if ((idx = atomic_inc_return(&list->used)) > list->hwm)
+		list->hwm = idx;
+	return p;
+}
+
+static inline void fast_slob_push(struct fast_slob *slob, struct fast_slob_list *list, void *p)
+{
+	unsigned long old, new, idx;
+
+	idx = ((char *)p - list->start) / list->alloc_size + 1;
+	do {
+		old = ACCESS_ONCE(list->head);
+		*(unsigned long *)p = old & slob->idx_mask;
+		new = fast_slob_next_head(slob, old, idx);
+	} while (cmpxchg(&list->head, old, new) != old);
+
+	atomic_dec(&list->used);
+}
+
+/* Granule of the spill region 'p' starts, or -1 if it's not on a granule boundary */
+static inline long fast_slob_spill_granule(struct fast_slob *slob, void *p)
+{
+	size_t off = (char *)p - slob->spill_start;
+
+	if (!slob->spill || (char *)p < slob->spill_start || (char *)p >= slob->end ||
+	    (off & ((1UL << SPILL_ALLOC_ORDER) - 1)))
+		return -1;
+
+	return off >> SPILL_ALLOC_ORDER;
+}
+
+static inline void *fast_slob_spill_alloc(struct fast_slob *slob, size_t size)
+{
+	unsigned long p;
+	long first;
+	int used;
+
+	size = ALIGN(size, 1UL << SPILL_ALLOC_ORDER);
+	p = gen_pool_alloc(slob->spill, size);
+	if (!p)
+		return NULL;
+
+	// the end is marked first, so that a buffer found by its start always has one
+	first = fast_slob_spill_granule(slob, (void *)p);
+	set_bit(first + (size >> SPILL_ALLOC_ORDER) - 1, slob->spill_ends);
+	smp_wmb();
+	set_bit(first, slob->spill_starts);
+
+	atomic_inc(&slob->spill_allocs);
+	if ((used = atomic_add_return(size, &slob->spill_used)) > slob->spill_hwm)
+		slob->spill_hwm = used;
+	return (void *)p;
+}
+
+/* Whether 'p' is the start of a spill buffer currently allocated */
+static inline int fast_slob_spill_valid(struct fast_slob *slob, void *p)
+{
+	long first = fast_slob_spill_granule(slob, p);
+
+	return first >= 0 && test_bit(first, slob->spill_starts);
+}
+
+/* The start bit is cleared atomically, so of racing frees of a buffer only one gets past it.
+   Buffers don't overlap, so the first end bit at or after the start is the buffer's own. */
+static inline void fast_slob_spill_free(struct fast_slob *slob, void *p)
+{
+	long first = fast_slob_spill_granule(slob, p), last;
+	size_t size;
+
+	if (first < 0 || !test_and_clear_bit(first, slob->spill_starts)) {
+		printk(KERN_WARNING "fast_slob: try to free an invalid spill buffer with address %p\n", p);
+		return;
+	}
+
+	last = find_next_bit(slob->spill_ends, slob->spill_granules, first);
+	clear_bit(last, slob->spill_ends);
+
+	size = (last - first + 1) << SPILL_ALLOC_ORDER;
+	atomic_sub(size, &slob->spill_used);
+	gen_pool_free(slob->spill, (unsigned long)p, size);
+}
+
+/* Index of the smallest bucket fitting 'size', or num_buckets if it's too big for any */
+static inline int fast_slob_size_to_bucket(struct fast_slob *slob, size_t size)
+{
+	if (size <= slob->min_alloc_size)
+		return 0;
+	if (size > slob->max_alloc_size)
+		return slob->num_buckets;
+
+	return DIV_ROUND_UP(fls_long((size - 1) / slob->min_alloc_size), slob->alloc_size_shift);
 }
 
 static inline void *fast_slob_alloc(struct fast_slob *slob, size_t size)
 {
-	size_t alloc_size = slob->min_alloc_size;
 	char *p;
 	int i;
 
-	spin_lock(&slob->lock);
-	for (i = 0; i < slob->num_buckets; i++) {
-		if (alloc_size >= size && slob->buckets[i]) {
-			p = slob->buckets[i];
-			slob->buckets[i] = *(char **)p;
-			spin_unlock(&slob->lock);
+	for (i = fast_slob_size_to_bucket(slob, size); i < slob->num_buckets; i++) {
+		if ((p = fast_slob_pop(slob, slob->buckets + i)))
 			return p;
-		}
-		alloc_size <<= slob->alloc_size_shift;
 	}
-	spin_unlock(&slob->lock);
 
+	if (slob->spill && (p = fast_slob_spill_alloc(slob, size)))
+		return p;
+
+	atomic_inc(&slob->failures);
 	return NULL;
 }
 
@@ -133,21 +330,27 @@ static inline int fast_slob_bucket(struct fast_slob *slob, void *p)
 	if ((char *)p < slob->start || (char *)p >= slob->end)
 		return -1;
 
+	if ((char *)p >= slob->spill_start)
+		return fast_slob_spill_valid(slob, p) ? slob->num_buckets : -1;
+
 	off = (char *)p - slob->start;
 	idx = off / slob->bucket_size;
-	alloc_size = slob->min_alloc_size << (idx * slob->alloc_size_shift);
-	if ((off - idx * slob->bucket_size) % ALIGN(alloc_size, MIN_ALLOC_SIZE))
+
+	off -= idx * slob->bucket_size;
+	alloc_size = ALIGN(slob->min_alloc_size << (idx * slob->alloc_size_shift), MIN_ALLOC_SIZE);
+	if ((off % alloc_size) || (off + alloc_size > slob->bucket_size))
 		return -1;
 
 	return idx;
 }
 
+/* 'idx' is as returned by fast_slob_bucket(), with num_buckets standing for the spill region */
 static inline void _fast_slob_free(struct fast_slob *slob, int idx, void *p)
 {
-	spin_lock(&slob->lock);
-	*(char **)p = slob->buckets[idx];
-	slob->buckets[idx] = p;
-	spin_unlock(&slob->lock);
+	if (idx < slob->num_buckets)
+		fast_slob_push(slob, slob->buckets + idx, p);
+	else
+		fast_slob_spill_free(slob, p);
 }
 
 static inline void fast_slob_free(struct fast_slob *slob, void *p)
@@ -0,0 +1,230 @@
+/*
+ * fast_slob_test.c: stress test of the fast_slob allocator
+ * Copyright (c) 2012 Rong Shen <rong1129@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+#include <linux/module.h>
+#include <linux/mm.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/delay.h>
+#include <linux/cpumask.h>
+#include <linux/completion.h>
+#include <linux/wait.h>
+#include <linux/math64.h>
+
+#include "fast_slob.h"
+
+
+#define HELD_BUFS		16	// buffers each thread keeps allocated, freeing the oldest first
+
+
+/* Loading the module runs one round per thread count from 1 to max_threads over a slob laid
+   out like binder_mmap() lays out a regular process's one, and logs allocs/sec for each */
+static int max_threads;			// 0: number of online cpus
+module_param(max_threads, int, S_IRUGO);
+
+static int duration_ms = 1000;
+module_param(duration_ms, int, S_IRUGO);
+
+static int slob_size = 1016 * 1024;
+module_param(slob_size, int, S_IRUGO);
+
+static int spill_percent = 25;
+module_param(spill_percent, int, S_IRUGO);
+
+/* parcel sizes, mostly small ones as in real binder traffic */
+static const size_t sizes[] = { 64, 96, 128, 200, 256, 400, 512, 1024, 64, 128, 2048, 4096, 160, 8192, 32768, 100 * 1024 };
+
+
+struct slob_test_thread {
+	struct task_struct *task;
+	struct fast_slob *slob;
+	unsigned long allocs;
+	unsigned long failures;
+	unsigned long errors;
+	u32 rnd;
+	struct completion done;
+};
+
+static DECLARE_WAIT_QUEUE_HEAD(test_wait);
+static int test_start, test_stop;
+
+
+static int slob_test_fn(void *data)
+{
+	struct slob_test_thread *t = data;
+	void *held[HELD_BUFS];
+	size_t size;
+	char *p;
+	int i, j;
+
+	memset(held, 0, sizeof(held));
+	wait_event(test_wait, ACCESS_ONCE(test_start));
+
+	for (i = 0; !ACCESS_ONCE(test_stop); i = (i + 1) % HELD_BUFS) {
+		if (held[i]) {
+			fast_slob_free(t->slob, held[i]);
+			held[i] = NULL;
+		}
+
+		t->rnd = t->rnd * 1103515245 + 12345;
+		size = sizes[(t->rnd >> 16) % ARRAY_SIZE(sizes)];
+
+		p = fast_slob_alloc(t->slob, size);
+		t->allocs++;
+		if (!p) {
+			t->failures++;
+			continue;
+		}
+
+		// a buffer handed out twice shows up as a tag overwritten by the other owner
+		if (fast_slob_bucket(t->slob, p) < 0)
+			t->errors++;
+		*(struct slob_test_thread **)p = t;
+		p[size - 1] = 0;
+		held[i] = p;
+
+		if (i == 0) {
+			for (j = 0; j < HELD_BUFS; j++) {
+				if (held[j] && *(struct slob_test_thread **)held[j] != t)
+					t->errors++;
+			}
+			cond_resched();
+		}
+	}
+
+	for (i = 0; i < HELD_BUFS; i++) {
+		if (held[i])
+			fast_slob_free(t->slob, held[i]);
+	}
+
+	complete(&t->done);
+	while (!kthread_should_stop())
+		schedule_timeout_interruptible(1);
+	return 0;
+}
+
+static int slob_test_leaked(struct fast_slob *slob)
+{
+	int i, leaked = 0;
+
+	for (i = 0; i < slob->num_buckets; i++)
+		leaked += atomic_read(&slob->buckets[i].used);
+	return leaked + atomic_read(&slob->spill_used);
+}
+
+static int slob_test_run(struct slob_test_thread *threads, int nr_threads)
+{
+	struct fast_slob *slob;
+	unsigned long allocs = 0, failures = 0, errors = 0;
+	u64 start, ns;
+	int i, cpu, r = 0;
+
+	slob = fast_slob_create(slob_size, 128 * 1024, 3, 4,
+				(spill_percent > 0 && spill_percent < 100) ? PAGE_ALIGN(slob_size * spill_percent / 100) : 0);
+	if (!slob)
+		return -ENOMEM;
+
+	test_start = 0;
+	test_stop = 0;
+
+	cpu = cpumask_first(cpu_online_mask);
+	for (i = 0; i < nr_threads; i++) {
+		struct slob_test_thread *t = threads + i;
+
+		memset(t, 0, sizeof(*t));
+		t->slob = slob;
+		t->rnd = i + 1;
+		init_completion(&t->done);
+
+		t->task = kthread_create(slob_test_fn, t, "fast_slob_test/%d", i);
+		if (IS_ERR(t->task)) {
+			r = PTR_ERR(t->task);
+			t->task = NULL;
+			test_stop = 1;
+			nr_threads = i;
+			break;
+		}
+
+		// one thread per cpu as long as there are enough of them
+		kthread_bind(t->task, cpu);
+		cpu = cpumask_next(cpu, cpu_online_mask);
+		if (cpu >= nr_cpu_ids)
+			cpu = cpumask_first(cpu_online_mask);
+		wake_up_process(t->task);
+	}
+
+	start = local_clock();
+	test_start = 1;
+	wake_up_all(&test_wait);
+	if (!r)
+		msleep(duration_ms);
+	test_stop = 1;
+
+	for (i = 0; i < nr_threads; i++) {
+		wait_for_completion(&threads[i].done);
+		kthread_stop(threads[i].task);
+
+		allocs += threads[i].allocs;
+		failures += threads[i].failures;
+		errors += threads[i].errors;
+	}
+	ns = local_clock() - start;
+
+	if (!r) {
+		printk(KERN_INFO "fast_slob_test: %d threads: %llu allocs/s, %lu failed, %lu in spill (%d hwm)\n",
+			nr_threads, div64_u64((u64)allocs * NSEC_PER_SEC, ns ? ns : 1), failures,
+			(unsigned long)atomic_read(&slob->spill_allocs), slob->spill_hwm);
+
+		if (errors || slob_test_leaked(slob)) {
+			printk(KERN_ERR "fast_slob_test: %d threads: %lu bad or shared buffers, %d leaked\n",
+				nr_threads, errors, slob_test_leaked(slob));
+			r = -EINVAL;
+		}
+	}
+
+	fast_slob_destroy(slob);
+	return r;
+}
+
+static int __init fast_slob_test_init(void)
+{
+	struct slob_test_thread *threads;
+	int n, r = 0;
+
+	if (max_threads <= 0)
+		max_threads = num_online_cpus();
+	if (duration_ms <= 0)
+		return -EINVAL;
+
+	threads = kcalloc(max_threads, sizeof(*threads), GFP_KERNEL);
+	if (!threads)
+		return -ENOMEM;
+
+	for (n = 1; n <= max_threads && !r; n++)
+		r = slob_test_run(threads, n);
+
+	kfree(threads);
+	return r;
+}
+
+static void __exit fast_slob_test_exit(void)
+{
+}
+
+module_init(fast_slob_test_init);
+module_exit(fast_slob_test_exit);
+MODULE_LICENSE("GPL");
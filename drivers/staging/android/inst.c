@@ -0,0 +1,228 @@
+/*
+ * inst.c: per-cpu instrumentation rings
+ * Copyright (c) 2012 Rong Shen <rong1129@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+#include <linux/module.h>
+#include <linux/types.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/sched.h>
+#include <linux/percpu.h>
+#include <linux/vmalloc.h>
+#include <linux/mutex.h>
+#include <linux/uaccess.h>
+#include <linux/debugfs.h>
+#include <asm/local.h>
+
+#include "inst.h"
+
+#define INST_RING_SIZE		(PAGE_SIZE + INST_RING_ENTRIES * sizeof(struct inst_entry))
+
+
+struct inst_cpu {
+	local_t next;			// entries reserved so far, ahead of hdr->head while being written
+	struct inst_ring_hdr *hdr;
+	struct inst_entry *entries;
+};
+
+struct static_key inst_key = STATIC_KEY_INIT_FALSE;
+EXPORT_SYMBOL(inst_key);
+
+static DEFINE_PER_CPU(struct inst_cpu, inst_cpu);
+static DEFINE_MUTEX(inst_lock);
+static int inst_enabled;
+static struct dentry *inst_dir;
+
+
+/* Called with the key on only, so the ring of this cpu has been allocated. Interrupts landing
+   in the middle of the recording just take the next slot; the entry being overwritten is
+   invalidated first so that readers never accept a half written one. */
+void __inst_entry(unsigned int point, unsigned long arg)
+{
+	struct inst_cpu *c = &get_cpu_var(inst_cpu);
+	struct inst_entry *e;
+	unsigned long i;
+
+	if (likely(c->hdr)) {
+		i = local_inc_return(&c->next) - 1;
+		e = c->entries + (i & (INST_RING_ENTRIES - 1));
+
+		e->seq = 0;
+		smp_wmb();
+
+		e->ts = local_clock();
+		e->point = point;
+		e->pid = current->pid;
+		e->arg = arg;
+
+		smp_wmb();
+		e->seq = i + 1;
+		c->hdr->head = local_read(&c->next);
+	}
+
+	put_cpu_var(inst_cpu);
+}
+EXPORT_SYMBOL(__inst_entry);
+
+static int inst_alloc_rings(void)
+{
+	struct inst_ring_hdr *hdr;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct inst_cpu *c = &per_cpu(inst_cpu, cpu);
+
+		if (c->hdr)
+			continue;
+
+		hdr = vmalloc_user(INST_RING_SIZE);
+		if (!hdr)
+			return -ENOMEM;
+
+		hdr->magic = INST_MAGIC;
+		hdr->cpu = cpu;
+		hdr->num_entries = INST_RING_ENTRIES;
+		hdr->entry_size = sizeof(struct inst_entry);
+
+		c->entries = (struct inst_entry *)((char *)hdr + PAGE_SIZE);
+		smp_wmb();
+		c->hdr = hdr;
+	}
+
+	return 0;
+}
+
+static int inst_set_enabled(int enable)
+{
+	int r = 0;
+
+	mutex_lock(&inst_lock);
+
+	if (enable && !inst_enabled) {
+		r = inst_alloc_rings();
+		if (!r) {
+			static_key_slow_inc(&inst_key);
+			inst_enabled = 1;
+		}
+	} else if (!enable && inst_enabled) {
+		static_key_slow_dec(&inst_key);
+		inst_enabled = 0;
+	}
+
+	mutex_unlock(&inst_lock);
+	return r;
+}
+
+static ssize_t inst_enable_read(struct file *filp, char __user *buf, size_t count, loff_t *ppos)
+{
+	char s[4];
+	int len;
+
+	len = snprintf(s, sizeof(s), "%d\n", inst_enabled);
+	return simple_read_from_buffer(buf, count, ppos, s, len);
+}
+
+static ssize_t inst_enable_write(struct file *filp, const char __user *buf, size_t count, loff_t *ppos)
+{
+	char s[4];
+	int r;
+
+	if (count >= sizeof(s))
+		return -EINVAL;
+	if (copy_from_user(s, buf, count))
+		return -EFAULT;
+	s[count] = '\0';
+
+	switch (s[0]) {
+		case '0':
+			r = inst_set_enabled(0);
+			break;
+
+		case '1':
+			r = inst_set_enabled(1);
+			break;
+
+		default:
+			r = -EINVAL;
+			break;
+	}
+
+	return r < 0 ? r : count;
+}
+
+static int inst_ring_open(struct inode *inode, struct file *filp)
+{
+	filp->private_data = inode->i_private;
+	return 0;
+}
+
+static int inst_ring_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	int cpu = (long)filp->private_data;
+	struct inst_ring_hdr *hdr = per_cpu(inst_cpu, cpu).hdr;
+
+	if (!hdr)
+		return -ENODEV;
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	if ((vma->vm_pgoff << PAGE_SHIFT) + (vma->vm_end - vma->vm_start) > PAGE_ALIGN(INST_RING_SIZE))
+		return -EINVAL;
+
+	return remap_vmalloc_range(vma, hdr, vma->vm_pgoff);
+}
+
+static const struct file_operations inst_enable_fops = {
+	.owner		= THIS_MODULE,
+	.read		= inst_enable_read,
+	.write		= inst_enable_write,
+	.llseek		= default_llseek,
+};
+
+static const struct file_operations inst_ring_fops = {
+	.owner		= THIS_MODULE,
+	.open		= inst_ring_open,
+	.mmap		= inst_ring_mmap,
+};
+
+static int __init inst_init(void)
+{
+	char name[16];
+	int cpu;
+
+	inst_dir = debugfs_create_dir("inst", NULL);
+	if (!inst_dir)
+		return -ENOMEM;
+
+	if (!debugfs_create_file("enable", S_IRUSR | S_IWUSR, inst_dir, NULL, &inst_enable_fops))
+		goto failed;
+
+	for_each_possible_cpu(cpu) {
+		snprintf(name, sizeof(name), "cpu%d", cpu);
+		if (!debugfs_create_file(name, S_IRUSR, inst_dir, (void *)(long)cpu, &inst_ring_fops))
+			goto failed;
+	}
+
+	return 0;
+
+failed:
+	debugfs_remove_recursive(inst_dir);
+	return -ENOMEM;
+}
+
+device_initcall(inst_init);
@@ -1,53 +1,59 @@
 #ifndef _INST_H
 #define _INST_H
 
-#undef KERNEL_INSTRUMENTING
-
-#ifdef KERNEL_INSTRUMENTING
-#include <linux/time.h>
-
-typedef union {
-	struct timeval tv;
-	char label[8];
-} inst_entry_t;
-
-typedef struct {
-	uint32_t magic;
-	uint32_t seq;
-	uint32_t max_entries;
-	uint32_t next_entry;
-	inst_entry_t entries[0];
-} inst_buf_t;
-
-
-static inline void __inst_entry(void *ptr, char *label, struct timeval *copy)
-{
-	inst_buf_t *inst = (inst_buf_t *)ptr;
-
-	if (inst->magic != 0x696e7374)
-		return;
-
-	if (inst->next_entry < inst->max_entries) {
-		inst_entry_t *entry = inst->entries + inst->next_entry++;
-
-		if (inst->seq) {
-			if (!copy) 
-				do_gettimeofday(&entry->tv);
-			else
-				entry->tv = *copy;
-		} else {
-			strncpy(entry->label, label, 8);
-			entry->label[7] = '\0';
-		}
-	}
-}
-#define INST_ENTRY(p, label)			__inst_entry((p), (label), NULL)
-#define INST_ENTRY_COPY(t, p, label, n)		__inst_entry((p), (label), (t)->__inst_copies + (n))
-#define INST_RECORD(t, n)			do_gettimeofday((t)->__inst_copies + (n));
+/*
+ * Per-cpu instrumentation rings. Each possible cpu owns a ring, exported as
+ * <debugfs>/inst/cpuN, that userspace maps read-only: a header page followed
+ * by INST_RING_ENTRIES entries. 'head' counts the entries ever written on
+ * that cpu, so entry i lives at entries[i & (INST_RING_ENTRIES - 1)] and has
+ * been overwritten once head - i > INST_RING_ENTRIES. An entry is valid only
+ * if its 'seq' equals the low 32 bits of i + 1 both before and after it has
+ * been copied out. Recording is switched on and off with <debugfs>/inst/enable.
+ */
+#define INST_MAGIC		0x696e7374
+#define INST_RING_SHIFT		12
+#define INST_RING_ENTRIES	(1 << INST_RING_SHIFT)
+
+enum inst_point {
+	INST_BINDER_WRITE_TRANSACTION = 1,
+	INST_BINDER_WRITE_REPLY,
+	INST_BINDER_READ_TRANSACTION,
+	INST_BINDER_READ_REPLY,
+	INST_BINDER_READ_BLOCK,
+	INST_BINDER_READ_WAKEUP,
+};
+
+struct inst_entry {
+	__u64 ts;		// local_clock() of the recording cpu, in ns
+	__u32 seq;
+	__u16 point;		// enum inst_point
+	__u16 pid;		// low 16 bits of the current thread id
+	__u64 arg;
+};
+
+struct inst_ring_hdr {
+	__u32 magic;
+	__u32 cpu;
+	__u32 num_entries;
+	__u32 entry_size;
+	__u64 head;
+};
+
+#ifdef __KERNEL__
+#ifdef CONFIG_ANDROID_INSTRUMENTING
+#include <linux/jump_label.h>
+
+extern struct static_key inst_key;
+extern void __inst_entry(unsigned int point, unsigned long arg);
+
+#define INST_ENTRY(point, arg)						\
+	do {								\
+		if (static_key_false(&inst_key))			\
+			__inst_entry((point), (unsigned long)(arg));	\
+	} while (0)
 #else
-#define INST_ENTRY(b, label)
-#define INST_ENTRY_COPY(t, p, label, n)
-#define INST_RECORD(t, n)
-#endif /* KERNEL_INSTRUMENTING */
+#define INST_ENTRY(point, arg)		do { } while (0)
+#endif /* CONFIG_ANDROID_INSTRUMENTING */
+#endif /* __KERNEL__ */
 
 #endif /* _INST_H */
@@ -25,44 +25,115 @@
 #include <linux/poll.h>
 #include <linux/slab.h>
 #include <linux/time.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
 #include "logger.h"
 
 #include <asm/ioctls.h>
 
+/*
+ * The ring is written in the records described in logger.h. Writers reserve
+ * a record with a cmpxchg on w_off and commit it by setting its 'seq'.
+ * Nothing is locked: readers tell a record is there by its 'seq' and, as
+ * writers move 'head' past what they are about to overwrite before they
+ * touch it, that what they copied out is intact by 'head' not having passed
+ * them since.
+ *
+ * In per-cpu mode (logger.percpu=1) a log is split into one ring per cpu and
+ * writers go to the ring of the cpu they run on. As they keep preemption
+ * disabled from reserving to committing, there is then at most one writer
+ * on a ring at a time and writers on different cpus share no cache lines.
+ * Readers pick the oldest entry at the front of all rings.
+ */
+
+/*
+ * struct logger_ring - a ring of records
+ *
+ * 'hdr' is the page readers can map in front of the ring, its 'w_off' and
+ * 'head' only move forward, through cmpxchg.
+ */
+struct logger_ring {
+	struct logger_mmap_hdr	*hdr;	/* shared header, followed by the ring */
+	unsigned char		*buffer;/* the ring buffer itself */
+	size_t			size;	/* size of the ring */
+};
+
 /*
  * struct logger_log - represents a specific log, such as 'main' or 'radio'
  *
  * This structure lives from module insertion until module removal, so it does
- * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * not need additional reference counting.
  */
 struct logger_log {
-	unsigned char		*buffer;/* the ring buffer itself */
+	struct logger_ring	*rings;	/* one, or one per cpu in per-cpu mode */
+	int			nr_rings;
 	struct miscdevice	misc;	/* misc device representing the log */
 	wait_queue_head_t	wq;	/* wait queue for readers */
-	struct list_head	readers; /* this log's readers */
-	struct mutex		mutex;	/* mutex protecting buffer */
-	size_t			w_off;	/* current write head offset */
-	size_t			head;	/* new readers start here */
-	size_t			size;	/* size of the log */
+	unsigned long		size;	/* size of the log, all rings together */
+	struct timespec		epoch;	/* compact entry times are relative to it */
 };
 
 /*
  * struct logger_reader - a logging device open for reading
  *
  * This object lives from open to release, so we don't need additional
- * reference counting. The structure is protected by log->mutex.
+ * reference counting. The structure is protected by 'mutex'.
  */
 struct logger_reader {
 	struct logger_log	*log;	/* associated log */
-	struct list_head	list;	/* entry in logger_log's list */
-	size_t			r_off;	/* current read head offset */
+	struct mutex		mutex;	/* serializes reads through this file */
+	__u32			r_off[0];/* next record to read, in each ring */
 };
 
-/* logger_offset - returns index 'n' into the log via (optimized) modulus */
-size_t logger_offset(struct logger_log *log, size_t n)
+/* one ring per cpu rather than one per log */
+static bool logger_percpu;
+module_param_named(percpu, logger_percpu, bool, S_IRUGO);
+
+/* entry headers written in the compact encoding */
+static bool logger_compact;
+module_param_named(compact, logger_compact, bool, S_IRUGO);
+
+/* logger_offset - returns index 'n' into the ring via (optimized) modulus */
+static inline size_t logger_offset(struct logger_ring *ring, size_t n)
 {
-	return n & (log->size-1);
+	return n & (ring->size-1);
+}
+
+static inline struct logger_rec *logger_rec(struct logger_ring *ring,
+					    __u32 pos)
+{
+	return (struct logger_rec *)(ring->buffer + logger_offset(ring, pos));
+}
+
+/*
+ * logger_rec_len_ok - could 'len' be the length of a record the driver has
+ * written? A 'seq' matching its position is no proof the record is one:
+ * the payload of another may be read there, and it is up to the writer.
+ */
+static inline int logger_rec_len_ok(size_t len)
+{
+	size_t max = ALIGN(sizeof(struct logger_rec) +
+			   max_t(size_t, LOGGER_COMPACT_MAX,
+				 sizeof(struct logger_entry)) +
+			   LOGGER_ENTRY_MAX_PAYLOAD, LOGGER_REC_ALIGN);
+
+	return len >= sizeof(struct logger_rec) && len <= max &&
+	       !(len % LOGGER_REC_ALIGN);
+}
+
+/* has 'head' moved past 'pos', i.e. may it have been overwritten? */
+static inline int logger_overrun(struct logger_ring *ring, __u32 pos)
+{
+	smp_rmb();
+	return (__s32)(ACCESS_ONCE(ring->hdr->head) - pos) > 0;
+}
+
+/* the ring of this cpu's writers, to be called with preemption disabled */
+static inline struct logger_ring *logger_this_ring(struct logger_log *log)
+{
+	return &log->rings[log->nr_rings > 1 ? smp_processor_id() : 0];
 }
 
 
@@ -89,52 +160,232 @@ static inline struct logger_log *file_get_log(struct file *file)
 		return file->private_data;
 }
 
+/* zigzag encoding, so that small negative numbers make short varints */
+static inline __u64 zigzag(__s64 v)
+{
+	return ((__u64)v << 1) ^ (__u64)(v >> 63);
+}
+
+static inline __s64 unzigzag(__u64 v)
+{
+	return (__s64)(v >> 1) ^ -(__s64)(v & 1);
+}
+
+static __u8 *put_varint(__u8 *p, __u64 v)
+{
+	while (v >= 0x80) {
+		*p++ = v | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+/* a varint truncated by 'end' reads as what has been seen of it */
+static const __u8 *get_varint(const __u8 *p, const __u8 *end, __u64 *v)
+{
+	int shift = 0;
+
+	*v = 0;
+	while (p < end && shift < 64) {
+		*v |= (__u64)(*p & 0x7f) << shift;
+		shift += 7;
+		if (!(*p++ & 0x80))
+			break;
+	}
+	return p;
+}
+
+/* microseconds from the Epoch, the resolution of compact entry times */
+static inline __s64 logger_time_us(__s32 sec, __s32 nsec)
+{
+	return (__s64)sec * USEC_PER_SEC + nsec / NSEC_PER_USEC;
+}
+
 /*
- * get_entry_len - Grabs the length of the payload of the next entry starting
- * from 'off'.
- *
- * An entry length is 2 bytes (16 bits) in host endian order.
- * In the log, the length does not include the size of the log entry structure.
- * This function returns the size including the log entry structure.
+ * encode_entry - lays the header of 'entry' out in 'buf' the way it is
+ * stored in a record with 'flags'. Returns its length.
+ */
+static size_t encode_entry(struct logger_log *log, struct logger_entry *entry,
+			   int flags, __u8 *buf)
+{
+	__u8 *p = buf;
+	__s64 t;
+
+	if (!(flags & LOGGER_REC_COMPACT)) {
+		memcpy(buf, entry, sizeof(struct logger_entry));
+		return sizeof(struct logger_entry);
+	}
+
+	t = logger_time_us(entry->sec, entry->nsec) -
+	    logger_time_us(log->epoch.tv_sec, log->epoch.tv_nsec);
+	p = put_varint(p, zigzag(t));
+	p = put_varint(p, (__u32)entry->pid);
+	p = put_varint(p, zigzag((__s64)entry->tid - entry->pid));
+	p = put_varint(p, entry->len);
+
+	return p - buf;
+}
+
+/*
+ * do_read_log - copies 'count' bytes from position 'pos' of 'ring' into
+ * 'buf', handling a wrap at the end of the ring.
+ */
+static void do_read_log(struct logger_ring *ring, __u32 pos,
+			void *buf, size_t count)
+{
+	size_t off = logger_offset(ring, pos);
+	size_t len;
+
+	len = min(count, ring->size - off);
+	memcpy(buf, ring->buffer + off, len);
+	if (count != len)
+		memcpy(buf + len, ring->buffer, count - len);
+}
+
+/*
+ * get_entry - fills 'entry' with the header of the entry in the record at
+ * position 'pos' of 'ring', whatever its encoding. Returns the offset of
+ * the payload from the start of the record.
  *
- * Caller needs to hold log->mutex.
+ * The result is only meaningful if logger_overrun() is false afterwards,
+ * though 'len' is kept within LOGGER_ENTRY_MAX_PAYLOAD in any case.
  */
-static __u32 get_entry_len(struct logger_log *log, size_t off)
+static size_t get_entry(struct logger_log *log, struct logger_ring *ring,
+			__u32 pos, struct logger_entry *entry)
 {
-	__u16 val;
+	struct logger_rec *rec = logger_rec(ring, pos);
+	__u8 buf[LOGGER_COMPACT_MAX];
+	const __u8 *p = buf, *end;
+	size_t len;
+	__u64 v;
+	__s64 t;
+	__s32 rem;
+
+	pos += sizeof(struct logger_rec);
 
-	/* copy 2 bytes from buffer, in memcpy order, */
-	/* handling possible wrap at end of buffer */
+	if (!(ACCESS_ONCE(rec->flags) & LOGGER_REC_COMPACT)) {
+		do_read_log(ring, pos, entry, sizeof(struct logger_entry));
+		entry->len = min_t(size_t, entry->len,
+				   LOGGER_ENTRY_MAX_PAYLOAD);
+		return sizeof(struct logger_rec) + sizeof(struct logger_entry);
+	}
+
+	len = min_t(size_t, ACCESS_ONCE(rec->len) - sizeof(struct logger_rec),
+		    sizeof(buf));
+	do_read_log(ring, pos, buf, len);
+	end = buf + len;
+
+	p = get_varint(p, end, &v);
+	t = logger_time_us(log->epoch.tv_sec, log->epoch.tv_nsec) +
+	    unzigzag(v);
+	entry->sec = div_s64_rem(t, USEC_PER_SEC, &rem);
+	entry->nsec = rem * NSEC_PER_USEC;
+	p = get_varint(p, end, &v);
+	entry->pid = v;
+	p = get_varint(p, end, &v);
+	entry->tid = entry->pid + unzigzag(v);
+	p = get_varint(p, end, &v);
+	entry->len = min_t(__u64, v, LOGGER_ENTRY_MAX_PAYLOAD);
+	entry->__pad = 0;
+
+	return sizeof(struct logger_rec) + (p - buf);
+}
 
-	((__u8 *)&val)[0] = log->buffer[off];
-	if (likely(off+1 < log->size))
-		((__u8 *)&val)[1] = log->buffer[off+1];
-	else
-		((__u8 *)&val)[1] = log->buffer[0];
+/*
+ * get_next_rec - moves the read position '*r_off' in 'ring' past padding
+ * and, if it has been lapped, up to the oldest intact record. Returns the
+ * length of the record it then points at, or 0 if none has been committed
+ * there yet.
+ *
+ * Caller must hold reader->mutex.
+ */
+static size_t get_next_rec(struct logger_ring *ring, __u32 *r_off)
+{
+	struct logger_rec *rec;
+	size_t len;
+	int flags;
 
-	return sizeof(struct logger_entry) + val;
+	while (1) {
+		if (logger_overrun(ring, *r_off))
+			*r_off = ACCESS_ONCE(ring->hdr->head);
+
+		rec = logger_rec(ring, *r_off);
+		if (ACCESS_ONCE(rec->seq) != LOGGER_REC_SEQ(*r_off)) {
+			if (logger_overrun(ring, *r_off))
+				continue;
+			return 0;
+		}
+		smp_rmb();
+		len = rec->len;
+		flags = rec->flags;
+		if (logger_overrun(ring, *r_off))
+			continue;
+		if (unlikely(!logger_rec_len_ok(len)))
+			return 0;
+
+		if (likely(!(flags & LOGGER_REC_PAD)))
+			return len;
+		*r_off += len;
+	}
 }
 
 /*
- * do_read_log_to_user - reads exactly 'count' bytes from 'log' into the
- * user-space buffer 'buf'. Returns 'count' on success.
+ * get_next_ring - finds the ring holding the next entry for 'reader', in
+ * per-cpu mode the one with the oldest entry at the front. Returns its index
+ * and the length of the record in '*rec_len', or -1 if all rings are empty.
  *
- * Caller must hold log->mutex.
+ * Caller must hold reader->mutex.
  */
-static ssize_t do_read_log_to_user(struct logger_log *log,
-				   struct logger_reader *reader,
-				   char __user *buf,
-				   size_t count)
+static int get_next_ring(struct logger_reader *reader, size_t *rec_len)
 {
+	struct logger_log *log = reader->log;
+	struct logger_entry entry;
+	__s64 t, oldest = 0;
+	int i, ret = -1;
+	size_t len;
+
+	if (log->nr_rings == 1) {
+		*rec_len = get_next_rec(&log->rings[0], &reader->r_off[0]);
+		return *rec_len ? 0 : -1;
+	}
+
+	/* an entry read as garbage is read again, see logger_read() */
+	for (i = 0; i < log->nr_rings; i++) {
+		len = get_next_rec(&log->rings[i], &reader->r_off[i]);
+		if (!len)
+			continue;
+
+		get_entry(log, &log->rings[i], reader->r_off[i], &entry);
+		t = (__s64)entry.sec * NSEC_PER_SEC + entry.nsec;
+		if (ret >= 0 && t >= oldest)
+			continue;
+
+		oldest = t;
+		*rec_len = len;
+		ret = i;
+	}
+
+	return ret;
+}
+
+/*
+ * do_read_log_to_user - reads exactly 'count' bytes from position 'pos' of
+ * 'ring' into the user-space buffer 'buf'. Returns 'count' on success.
+ */
+static ssize_t do_read_log_to_user(struct logger_ring *ring, __u32 pos,
+				   char __user *buf, size_t count)
+{
+	size_t off = logger_offset(ring, pos);
 	size_t len;
 
 	/*
 	 * We read from the log in two disjoint operations. First, we read from
-	 * the current read head offset up to 'count' bytes or to the end of
-	 * the log, whichever comes first.
+	 * the read position up to 'count' bytes or to the end of the log,
+	 * whichever comes first.
 	 */
-	len = min(count, log->size - reader->r_off);
-	if (copy_to_user(buf, log->buffer + reader->r_off, len))
+	len = min(count, ring->size - off);
+	if (copy_to_user(buf, ring->buffer + off, len))
 		return -EFAULT;
 
 	/*
@@ -142,11 +393,9 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 	 * the log.
 	 */
 	if (count != len)
-		if (copy_to_user(buf + len, log->buffer, count - len))
+		if (copy_to_user(buf + len, ring->buffer, count - len))
 			return -EFAULT;
 
-	reader->r_off = logger_offset(log, reader->r_off + count);
-
 	return count;
 }
 
@@ -157,7 +406,8 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
  *
  *	- O_NONBLOCK works
  *	- If there are no log entries to read, blocks until log is written to
- *	- Atomically reads exactly one log entry
+ *	- Atomically reads exactly one log entry, as a struct logger_entry and
+ *	  its payload whatever the encoding in the ring
  *
  * Optimal read size is LOGGER_ENTRY_MAX_LEN. Will set errno to EINVAL if read
  * buffer is insufficient to hold next entry.
@@ -167,19 +417,23 @@ static ssize_t logger_read(struct file *file, char __user *buf,
 {
 	struct logger_reader *reader = file->private_data;
 	struct logger_log *log = reader->log;
+	struct logger_ring *ring;
+	struct logger_entry entry;
+	__u32 r_off;
+	size_t rec_len, off;
 	ssize_t ret;
+	int i;
 	DEFINE_WAIT(wait);
 
 start:
 	while (1) {
-		mutex_lock(&log->mutex);
-
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
-		ret = (log->w_off == reader->r_off);
-		mutex_unlock(&log->mutex);
-		if (!ret)
+		mutex_lock(&reader->mutex);
+		i = get_next_ring(reader, &rec_len);
+		if (i >= 0)
 			break;
+		mutex_unlock(&reader->mutex);
 
 		if (file->f_flags & O_NONBLOCK) {
 			ret = -EAGAIN;
@@ -195,151 +449,210 @@ start:
 	}
 
 	finish_wait(&log->wq, &wait);
-	if (ret)
+	if (i < 0)
 		return ret;
 
-	mutex_lock(&log->mutex);
-
-	/* is there still something to read or did we race? */
-	if (unlikely(log->w_off == reader->r_off)) {
-		mutex_unlock(&log->mutex);
+	/* get the header of the entry in the record */
+	ring = &log->rings[i];
+	r_off = reader->r_off[i];
+	off = get_entry(log, ring, r_off, &entry);
+	if (logger_overrun(ring, r_off)) {
+		mutex_unlock(&reader->mutex);
 		goto start;
 	}
-
-	/* get the size of the next entry */
-	ret = get_entry_len(log, reader->r_off);
+	ret = sizeof(struct logger_entry) + entry.len;
 	if (count < ret) {
 		ret = -EINVAL;
 		goto out;
 	}
 
 	/* get exactly one entry from the log */
-	ret = do_read_log_to_user(log, reader, buf, ret);
+	if (copy_to_user(buf, &entry, sizeof(struct logger_entry))) {
+		ret = -EFAULT;
+		goto out;
+	}
+	ret = do_read_log_to_user(ring, r_off + off,
+				  buf + sizeof(struct logger_entry), entry.len);
+	if (ret < 0)
+		goto out;
+
+	/* did a writer lap us while we copied it? */
+	if (logger_overrun(ring, r_off)) {
+		mutex_unlock(&reader->mutex);
+		goto start;
+	}
+	reader->r_off[i] = r_off + rec_len;
+	ret += sizeof(struct logger_entry);
 
 out:
-	mutex_unlock(&log->mutex);
+	mutex_unlock(&reader->mutex);
 
 	return ret;
 }
 
 /*
- * get_next_entry - return the offset of the first valid entry at least 'len'
- * bytes after 'off'.
+ * push_head - moves ring->hdr->head record by record until the ring from it
+ * up to position 'end' fits the buffer.
  *
- * Caller must hold log->mutex.
+ * Writers call this with preemption disabled, after reserving up to 'end'
+ * but before writing anything. As no writer sleeps between reserving and
+ * committing, a record head runs into is at worst being written on another
+ * cpu and is committed shortly.
  */
-static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
+static void push_head(struct logger_ring *ring, __u32 end)
 {
-	size_t count = 0;
+	__u32 head;
+	struct logger_rec *rec;
+	size_t len;
 
-	do {
-		size_t nr = get_entry_len(log, off);
-		off = logger_offset(log, off + nr);
-		count += nr;
-	} while (count < len);
+	while (1) {
+		head = ACCESS_ONCE(ring->hdr->head);
+		if ((__s32)(end - head) <= (__s32)ring->size)
+			break;
 
-	return off;
+		rec = logger_rec(ring, head);
+		if (ACCESS_ONCE(rec->seq) != LOGGER_REC_SEQ(head)) {
+			cpu_relax();
+			continue;
+		}
+		smp_rmb();
+		len = ACCESS_ONCE(rec->len);
+		if (unlikely(!logger_rec_len_ok(len))) {
+			cpu_relax();
+			continue;
+		}
+		cmpxchg(&ring->hdr->head, head, head + len);
+	}
 }
 
 /*
- * is_between - is a < c < b, accounting for wrapping of a, b, and c
- *    positions in the buffer
- *
- * That is, if a<b, check for c between a and b
- * and if a>b, check for c outside (not between) a and b
+ * reserve_rec - claims 'len' bytes at the write head of 'ring' and returns
+ * their position.
  *
- * |------- a xxxxxxxx b --------|
- *               c^
+ * The header slot still holds bytes of the previous lap, maybe a payload
+ * made to look like a committed record there. It is invalidated with a seq
+ * no position has before anything is written, once push_head() has moved
+ * head past the record it belonged to.
  *
- * |xxxxx b --------- a xxxxxxxxx|
- *    c^
- *  or                    c^
+ * Caller must have preemption disabled until commit_rec().
  */
-static inline int is_between(size_t a, size_t b, size_t c)
-{
-	if (a < b) {
-		/* is c between a and b? */
-		if (a < c && c <= b)
-			return 1;
-	} else {
-		/* is c outside of b through a? */
-		if (c <= b || a < c)
-			return 1;
-	}
+static __u32 reserve_rec(struct logger_ring *ring, size_t len)
+{
+	__u32 old;
 
-	return 0;
+	do {
+		old = ACCESS_ONCE(ring->hdr->w_off);
+	} while (cmpxchg(&ring->hdr->w_off, old, old + len) != old);
+
+	push_head(ring, old + len);
+
+	logger_rec(ring, old)->seq = 0;
+	smp_wmb();
+
+	return old;
 }
 
 /*
- * fix_up_readers - walk the list of all readers and "fix up" any who were
- * lapped by the writer; also do the same for the default "start head".
- * We do this by "pulling forward" the readers and start head to the first
- * entry after the new write head.
- *
- * The caller needs to hold log->mutex.
+ * commit_rec - makes the record reserved at 'pos' visible to readers
  */
-static void fix_up_readers(struct logger_log *log, size_t len)
+static void commit_rec(struct logger_ring *ring, __u32 pos,
+		       size_t len, int flags)
 {
-	size_t old = log->w_off;
-	size_t new = logger_offset(log, old + len);
-	struct logger_reader *reader;
-
-	if (is_between(old, new, log->head))
-		log->head = get_next_entry(log, log->head, len);
+	struct logger_rec *rec = logger_rec(ring, pos);
 
-	list_for_each_entry(reader, &log->readers, list)
-		if (is_between(old, new, reader->r_off))
-			reader->r_off = get_next_entry(log, reader->r_off, len);
+	rec->len = len;
+	rec->flags = flags;
+	smp_wmb();
+	rec->seq = LOGGER_REC_SEQ(pos);
 }
 
 /*
- * do_write_log - writes 'len' bytes from 'buf' to 'log'
- *
- * The caller needs to hold log->mutex.
+ * do_write_log - writes 'count' bytes from 'buf' to position 'pos' of 'ring'
  */
-static void do_write_log(struct logger_log *log, const void *buf, size_t count)
+static void do_write_log(struct logger_ring *ring, __u32 pos,
+			 const void *buf, size_t count)
 {
+	size_t off = logger_offset(ring, pos);
 	size_t len;
 
-	len = min(count, log->size - log->w_off);
-	memcpy(log->buffer + log->w_off, buf, len);
+	len = min(count, ring->size - off);
+	memcpy(ring->buffer + off, buf, len);
 
 	if (count != len)
-		memcpy(log->buffer, buf + len, count - len);
-
-	log->w_off = logger_offset(log, log->w_off + count);
-
+		memcpy(ring->buffer, buf + len, count - len);
 }
 
 /*
- * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
- *
- * The caller needs to hold log->mutex.
+ * do_write_log_from_user - writes 'count' bytes from the user-space buffer
+ * 'buf' to position 'pos' of 'ring', with page faults disabled.
  *
- * Returns 'count' on success, negative error code on failure.
+ * Returns 'count' on success, -EFAULT if some of it was not resident.
  */
-static ssize_t do_write_log_from_user(struct logger_log *log,
+static ssize_t do_write_log_from_user(struct logger_ring *ring,
+				      __u32 pos,
 				      const void __user *buf, size_t count)
 {
+	size_t off = logger_offset(ring, pos);
 	size_t len;
 
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
+	len = min(count, ring->size - off);
+	if (len && __copy_from_user_inatomic(ring->buffer + off, buf, len))
 		return -EFAULT;
 
 	if (count != len)
-		if (copy_from_user(log->buffer, buf + len, count - len))
-			/*
-			 * Note that by not updating w_off, this abandons the
-			 * portion of the new entry that *was* successfully
-			 * copied, just above.  This is intentional to avoid
-			 * message corruption from missing fragments.
-			 */
+		if (__copy_from_user_inatomic(ring->buffer, buf + len,
+					      count - len))
 			return -EFAULT;
 
-	log->w_off = logger_offset(log, log->w_off + count);
+	return count;
+}
+
+/*
+ * logger_write_slow - writes an entry whose payload could not be copied in
+ * with page faults disabled: it is copied into a bounce buffer first, with
+ * nothing reserved.
+ */
+static ssize_t logger_write_slow(struct logger_log *log,
+				 struct logger_entry *header, int flags,
+				 const struct iovec *iov,
+				 unsigned long nr_segs)
+{
+	struct logger_ring *ring;
+	__u8 hbuf[LOGGER_COMPACT_MAX];
+	size_t hdr_len, rec_len;
+	__u32 pos;
+	char *payload;
+	size_t count = 0;
 
+	payload = kmalloc(header->len, GFP_KERNEL);
+	if (!payload)
+		return -ENOMEM;
+
+	while (nr_segs-- > 0 && count < header->len) {
+		size_t len = min_t(size_t, iov->iov_len, header->len - count);
+
+		if (copy_from_user(payload + count, iov->iov_base, len)) {
+			kfree(payload);
+			return -EFAULT;
+		}
+		iov++;
+		count += len;
+	}
+
+	hdr_len = encode_entry(log, header, flags, hbuf);
+	rec_len = ALIGN(sizeof(struct logger_rec) + hdr_len + header->len,
+			LOGGER_REC_ALIGN);
+
+	preempt_disable();
+	ring = logger_this_ring(log);
+	pos = reserve_rec(ring, rec_len);
+	do_write_log(ring, pos + sizeof(struct logger_rec), hbuf, hdr_len);
+	do_write_log(ring, pos + sizeof(struct logger_rec) + hdr_len,
+		     payload, header->len);
+	commit_rec(ring, pos, rec_len, flags);
+	preempt_enable();
+
+	kfree(payload);
 	return count;
 }
 
@@ -352,55 +665,76 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
+	const struct iovec *seg = iov;
+	unsigned long nr = nr_segs;
+	struct logger_ring *ring;
 	struct logger_entry header;
 	struct timespec now;
+	__u8 hbuf[LOGGER_COMPACT_MAX];
+	int flags = logger_compact ? LOGGER_REC_COMPACT : 0;
+	__u32 pos, off;
+	size_t hdr_len, rec_len;
 	ssize_t ret = 0;
 
-	now = current_kernel_time();
-
 	header.pid = current->tgid;
 	header.tid = current->pid;
-	header.sec = now.tv_sec;
-	header.nsec = now.tv_nsec;
 	header.len = min_t(size_t, iocb->ki_left, LOGGER_ENTRY_MAX_PAYLOAD);
+	header.__pad = 0;
 
 	/* null writes succeed, return zero */
 	if (unlikely(!header.len))
 		return 0;
 
-	mutex_lock(&log->mutex);
-
 	/*
-	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
+	 * Nothing may sleep between reserving and committing, see push_head(),
+	 * so the payload is copied in with page faults disabled. If some of it
+	 * is not resident, the record is committed as padding and the entry
+	 * goes through logger_write_slow() instead.
+	 *
+	 * The time is taken once on the cpu, for entries to be in time order
+	 * within a ring in per-cpu mode.
 	 */
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
+	preempt_disable();
+	pagefault_disable();
+
+	ring = logger_this_ring(log);
+	now = current_kernel_time();
+	header.sec = now.tv_sec;
+	header.nsec = now.tv_nsec;
+	hdr_len = encode_entry(log, &header, flags, hbuf);
+	rec_len = ALIGN(sizeof(struct logger_rec) + hdr_len + header.len,
+			LOGGER_REC_ALIGN);
 
-	do_write_log(log, &header, sizeof(struct logger_entry));
+	pos = reserve_rec(ring, rec_len);
+	off = pos + sizeof(struct logger_rec);
+	do_write_log(ring, off, hbuf, hdr_len);
+	off += hdr_len;
 
-	while (nr_segs-- > 0) {
+	while (nr-- > 0 && ret < header.len) {
 		size_t len;
-		ssize_t nr;
+		ssize_t n;
 
 		/* figure out how much of this vector we can keep */
-		len = min_t(size_t, iov->iov_len, header.len - ret);
+		len = min_t(size_t, seg->iov_len, header.len - ret);
 
 		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
-		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
-			return nr;
-		}
+		n = do_write_log_from_user(ring, off, seg->iov_base, len);
+		if (unlikely(n < 0))
+			break;
 
-		iov++;
-		ret += nr;
+		seg++;
+		off += n;
+		ret += n;
 	}
 
-	mutex_unlock(&log->mutex);
+	commit_rec(ring, pos, rec_len,
+		   ret == header.len ? flags : LOGGER_REC_PAD);
+
+	pagefault_enable();
+	preempt_enable();
+
+	if (unlikely(ret != header.len))
+		ret = logger_write_slow(log, &header, flags, iov, nr_segs);
 
 	/* wake up any blocked readers */
 	wake_up_interruptible(&log->wq);
@@ -430,18 +764,17 @@ static int logger_open(struct inode *inode, struct file *file)
 
 	if (file->f_mode & FMODE_READ) {
 		struct logger_reader *reader;
+		int i;
 
-		reader = kmalloc(sizeof(struct logger_reader), GFP_KERNEL);
+		reader = kmalloc(sizeof(struct logger_reader) +
+				 log->nr_rings * sizeof(__u32), GFP_KERNEL);
 		if (!reader)
 			return -ENOMEM;
 
 		reader->log = log;
-		INIT_LIST_HEAD(&reader->list);
-
-		mutex_lock(&log->mutex);
-		reader->r_off = log->head;
-		list_add_tail(&reader->list, &log->readers);
-		mutex_unlock(&log->mutex);
+		mutex_init(&reader->mutex);
+		for (i = 0; i < log->nr_rings; i++)
+			reader->r_off[i] = ACCESS_ONCE(log->rings[i].hdr->head);
 
 		file->private_data = reader;
 	} else
@@ -459,11 +792,6 @@ static int logger_release(struct inode *ignored, struct file *file)
 {
 	if (file->f_mode & FMODE_READ) {
 		struct logger_reader *reader = file->private_data;
-		struct logger_log *log = reader->log;
-
-		mutex_lock(&log->mutex);
-		list_del(&reader->list);
-		mutex_unlock(&log->mutex);
 
 		kfree(reader);
 	}
@@ -485,6 +813,7 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 	struct logger_reader *reader;
 	struct logger_log *log;
 	unsigned int ret = POLLOUT | POLLWRNORM;
+	size_t rec_len;
 
 	if (!(file->f_mode & FMODE_READ))
 		return ret;
@@ -494,21 +823,76 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 
 	poll_wait(file, &log->wq, wait);
 
-	mutex_lock(&log->mutex);
-	if (log->w_off != reader->r_off)
+	mutex_lock(&reader->mutex);
+	if (get_next_ring(reader, &rec_len) >= 0)
 		ret |= POLLIN | POLLRDNORM;
-	mutex_unlock(&log->mutex);
+	mutex_unlock(&reader->mutex);
 
 	return ret;
 }
 
+/*
+ * logger_mmap - maps the header page and a ring read-only, for readers to
+ * go through the log without a read() per entry, see logger.h.
+ */
+static int logger_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct logger_log *log;
+	struct logger_ring *ring;
+	unsigned long ring_pages, pgoff;
+
+	if (!(file->f_mode & FMODE_READ))
+		return -EBADF;
+	log = file_get_log(file);
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	/* all rings of a log have the same size */
+	ring_pages = (PAGE_SIZE + log->rings[0].size) >> PAGE_SHIFT;
+	if (vma->vm_pgoff / ring_pages >= log->nr_rings)
+		return -EINVAL;
+	ring = &log->rings[vma->vm_pgoff / ring_pages];
+	pgoff = vma->vm_pgoff % ring_pages;
+
+	if ((pgoff << PAGE_SHIFT) + (vma->vm_end - vma->vm_start) >
+	    PAGE_SIZE + ring->size)
+		return -EINVAL;
+
+	return remap_vmalloc_range(vma, ring->hdr, pgoff);
+}
+
+/*
+ * flush_log - drops everything written so far, by moving head up to the
+ * write head of each ring. Readers behind it catch up on their next read.
+ */
+static void flush_log(struct logger_log *log)
+{
+	struct logger_ring *ring;
+	__u32 head, w_off;
+	int i;
+
+	for (i = 0; i < log->nr_rings; i++) {
+		ring = &log->rings[i];
+		do {
+			head = ACCESS_ONCE(ring->hdr->head);
+			w_off = ACCESS_ONCE(ring->hdr->w_off);
+			if ((__s32)(w_off - head) <= 0)
+				break;
+		} while (cmpxchg(&ring->hdr->head, head, w_off) != head);
+	}
+}
+
 static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	struct logger_log *log = file_get_log(file);
 	struct logger_reader *reader;
+	struct logger_read_pos rpos;
+	struct logger_entry entry;
+	size_t rec_len;
 	long ret = -ENOTTY;
-
-	mutex_lock(&log->mutex);
+	int i;
 
 	switch (cmd) {
 	case LOGGER_GET_LOG_BUF_SIZE:
@@ -519,11 +903,16 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			ret = -EBADF;
 			break;
 		}
+		/* record headers and writes in flight included */
 		reader = file->private_data;
-		if (log->w_off >= reader->r_off)
-			ret = log->w_off - reader->r_off;
-		else
-			ret = (log->size - reader->r_off) + log->w_off;
+		mutex_lock(&reader->mutex);
+		ret = 0;
+		for (i = 0; i < log->nr_rings; i++) {
+			get_next_rec(&log->rings[i], &reader->r_off[i]);
+			ret += (__u32)(ACCESS_ONCE(log->rings[i].hdr->w_off) -
+				       reader->r_off[i]);
+		}
+		mutex_unlock(&reader->mutex);
 		break;
 	case LOGGER_GET_NEXT_ENTRY_LEN:
 		if (!(file->f_mode & FMODE_READ)) {
@@ -531,25 +920,51 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off != reader->r_off)
-			ret = get_entry_len(log, reader->r_off);
-		else
+		mutex_lock(&reader->mutex);
+		do {
 			ret = 0;
+			i = get_next_ring(reader, &rec_len);
+			if (i < 0)
+				break;
+			get_entry(log, &log->rings[i], reader->r_off[i],
+				  &entry);
+			ret = sizeof(struct logger_entry) + entry.len;
+		} while (logger_overrun(&log->rings[i], reader->r_off[i]));
+		mutex_unlock(&reader->mutex);
+		break;
+	case LOGGER_SET_READ_POS:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		/* a reader of the mapping tells us how far it got, for poll() */
+		if (copy_from_user(&rpos, (void __user *)arg, sizeof(rpos))) {
+			ret = -EFAULT;
+			break;
+		}
+		if (rpos.ring >= log->nr_rings ||
+		    (__s32)(ACCESS_ONCE(log->rings[rpos.ring].hdr->w_off) -
+			    rpos.pos) < 0 ||
+		    rpos.pos % LOGGER_REC_ALIGN) {
+			ret = -EINVAL;
+			break;
+		}
+		reader = file->private_data;
+		mutex_lock(&reader->mutex);
+		reader->r_off[rpos.ring] = rpos.pos;
+		mutex_unlock(&reader->mutex);
+		ret = 0;
 		break;
 	case LOGGER_FLUSH_LOG:
 		if (!(file->f_mode & FMODE_WRITE)) {
 			ret = -EBADF;
 			break;
 		}
-		list_for_each_entry(reader, &log->readers, list)
-			reader->r_off = log->w_off;
-		log->head = log->w_off;
+		flush_log(log);
 		ret = 0;
 		break;
 	}
 
-	mutex_unlock(&log->mutex);
-
 	return ret;
 }
 
@@ -558,6 +973,7 @@ static const struct file_operations logger_fops = {
 	.read = logger_read,
 	.aio_write = logger_aio_write,
 	.poll = logger_poll,
+	.mmap = logger_mmap,
 	.unlocked_ioctl = logger_ioctl,
 	.compat_ioctl = logger_ioctl,
 	.open = logger_open,
@@ -565,14 +981,13 @@ static const struct file_operations logger_fops = {
 };
 
 /*
- * Defines a log structure with name 'NAME' and a size of 'SIZE' bytes, which
- * must be a power of two, greater than LOGGER_ENTRY_MAX_LEN, and less than
- * LONG_MAX minus LOGGER_ENTRY_MAX_LEN.
+ * Defines a log structure with name 'NAME' and a default size of 'SIZE'
+ * bytes, which logger.<NAME>_size= overrides. The rings are allocated by
+ * init_log(), which rounds the size of each down to a power of two within
+ * LOGGER_RING_MIN and LOGGER_RING_MAX.
  */
 #define DEFINE_LOGGER_DEVICE(VAR, NAME, SIZE) \
-static unsigned char _buf_ ## VAR[SIZE]; \
 static struct logger_log VAR = { \
-	.buffer = _buf_ ## VAR, \
 	.misc = { \
 		.minor = MISC_DYNAMIC_MINOR, \
 		.name = NAME, \
@@ -580,12 +995,12 @@ static struct logger_log VAR = { \
 		.parent = NULL, \
 	}, \
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
-	.readers = LIST_HEAD_INIT(VAR .readers), \
-	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
-	.w_off = 0, \
-	.head = 0, \
 	.size = SIZE, \
-};
+}; \
+module_param_named(VAR##_size, VAR.size, ulong, S_IRUGO);
+
+#define LOGGER_RING_MIN		(4 * LOGGER_ENTRY_MAX_LEN)
+#define LOGGER_RING_MAX		(1UL << 30)	/* positions are 32-bit */
 
 DEFINE_LOGGER_DEVICE(log_main, LOGGER_LOG_MAIN, 256*1024)
 DEFINE_LOGGER_DEVICE(log_events, LOGGER_LOG_EVENTS, 256*1024)
@@ -605,27 +1020,76 @@ static struct logger_log *get_log_from_minor(int minor)
 	return NULL;
 }
 
+static void __init free_log(struct logger_log *log)
+{
+	int i;
+
+	for (i = 0; i < log->nr_rings; i++)
+		vfree(log->rings[i].hdr);
+	kfree(log->rings);
+}
+
 static int __init init_log(struct logger_log *log)
 {
-	int ret;
+	struct logger_ring *ring;
+	unsigned long ring_size;
+	int nr_rings = logger_percpu ? nr_cpu_ids : 1;
+	int i, ret;
+
+	ring_size = clamp_t(unsigned long, log->size / nr_rings,
+			    LOGGER_RING_MIN, LOGGER_RING_MAX);
+	ring_size = rounddown_pow_of_two(ring_size);
+
+	log->rings = kcalloc(nr_rings, sizeof(struct logger_ring), GFP_KERNEL);
+	if (unlikely(!log->rings))
+		goto nomem;
+	log->nr_rings = nr_rings;
+	log->size = ring_size * nr_rings;
+	log->epoch = current_kernel_time();
+
+	for (i = 0; i < nr_rings; i++) {
+		ring = &log->rings[i];
+		ring->hdr = vmalloc_user(PAGE_SIZE + ring_size);
+		if (unlikely(!ring->hdr))
+			goto nomem;
+		ring->hdr->magic = LOGGER_MMAP_MAGIC;
+		ring->hdr->size = ring_size;
+		ring->hdr->data_offset = PAGE_SIZE;
+		ring->hdr->cpu = i;
+		ring->hdr->nr_rings = nr_rings;
+		ring->hdr->epoch_sec = log->epoch.tv_sec;
+		ring->hdr->epoch_nsec = log->epoch.tv_nsec;
+		ring->buffer = (unsigned char *)ring->hdr + PAGE_SIZE;
+		ring->size = ring_size;
+	}
 
 	ret = misc_register(&log->misc);
 	if (unlikely(ret)) {
+		free_log(log);
 		printk(KERN_ERR "logger: failed to register misc "
 		       "device for log '%s'!\n", log->misc.name);
 		return ret;
 	}
 
-	printk(KERN_INFO "logger: created %luK log '%s'\n",
-	       (unsigned long) log->size >> 10, log->misc.name);
+	printk(KERN_INFO "logger: created %luK log '%s' in %d ring(s)\n",
+	       log->size >> 10, log->misc.name, nr_rings);
 
 	return 0;
+
+nomem:
+	free_log(log);
+	printk(KERN_ERR "logger: failed to allocate log '%s'!\n",
+	       log->misc.name);
+	return -ENOMEM;
 }
 
 static int __init logger_init(void)
 {
 	int ret;
 
+	/* the header buffers of the writers hold either encoding */
+	BUILD_BUG_ON(sizeof(struct logger_entry) > LOGGER_COMPACT_MAX);
+
 	ret = init_log(&log_main);
 	if (unlikely(ret))
 		goto out;
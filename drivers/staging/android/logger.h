@@ -39,11 +39,76 @@ struct logger_entry {
 #define LOGGER_ENTRY_MAX_PAYLOAD	\
 	(LOGGER_ENTRY_MAX_LEN - sizeof(struct logger_entry))
 
+/*
+ * In the ring, each entry is the payload of a record: a struct logger_rec,
+ * then the struct logger_entry and its payload, padded to LOGGER_REC_ALIGN.
+ * Positions are 32-bit counts of the bytes ever written, to be compared
+ * through their signed difference; the record at position 'pos' starts at
+ * offset pos & (size - 1) of the ring and has been committed once its 'seq'
+ * is LOGGER_REC_SEQ(pos).
+ */
+struct logger_rec {
+	__u32		seq;	/* LOGGER_REC_SEQ() of its position once committed, 0 until then */
+	__u16		len;	/* of the whole record, this header and padding included */
+	__u16		flags;
+};
+
+#define LOGGER_REC_ALIGN	sizeof(struct logger_rec)
+#define LOGGER_REC_PAD		0x1	/* abandoned write, to be skipped */
+#define LOGGER_REC_COMPACT	0x2	/* entry header in the compact encoding */
+#define LOGGER_REC_SEQ(pos)	((__u32)((pos) / LOGGER_REC_ALIGN) + 1)
+
+/*
+ * A record flagged LOGGER_REC_COMPACT holds, in place of the struct
+ * logger_entry, the same fields as unsigned LEB128 varints (7 bits a byte,
+ * low bits first, the top bit set on all bytes but the last), in order:
+ *
+ *	time	microseconds since the epoch in the mapping header, zigzag
+ *		encoded ((d << 1) ^ (d >> 63)) as the clock may be set back
+ *	pid
+ *	tid	zigzag encoded difference from pid
+ *	len	of the payload, which follows
+ */
+#define LOGGER_COMPACT_MAX	24	/* longest compact entry header */
+
+/*
+ * A log can be mapped read-only by its readers: this header page, then the
+ * ring at 'data_offset'. A record read out of the mapping is intact if 'head'
+ * has not moved past its position afterwards (with a read barrier between).
+ * Readers of the mapping hand their position to LOGGER_SET_READ_POS before
+ * poll()ing for more.
+ *
+ * A log in per-cpu mode has 'nr_rings' such rings, one per cpu, each behind
+ * a header page of its own; ring i is mapped at offset
+ * i * (data_offset + size). Entries are then in order within a ring only,
+ * readers merge the rings by entry time.
+ */
+struct logger_mmap_hdr {
+	__u32		magic;		/* LOGGER_MMAP_MAGIC */
+	__u32		size;		/* of the ring */
+	__u32		data_offset;	/* of the ring from the start of the mapping */
+	__u32		w_off;		/* next position to be reserved by a writer */
+	__u32		head;		/* oldest intact record */
+	__u32		cpu;		/* whose writes the ring holds, in per-cpu mode */
+	__u32		nr_rings;	/* of the log */
+	__s32		epoch_sec;	/* compact entry times are relative to this */
+	__s32		epoch_nsec;
+};
+
+#define LOGGER_MMAP_MAGIC	0x6c6f6772	/* "logr" */
+
+struct logger_read_pos {
+	__u32		ring;		/* index, 0 unless in per-cpu mode */
+	__u32		pos;		/* of the next record to be read */
+};
+
 #define __LOGGERIO	0xAE
 
 #define LOGGER_GET_LOG_BUF_SIZE		_IO(__LOGGERIO, 1) /* size of log */
 #define LOGGER_GET_LOG_LEN		_IO(__LOGGERIO, 2) /* used log len */
 #define LOGGER_GET_NEXT_ENTRY_LEN	_IO(__LOGGERIO, 3) /* next entry len */
 #define LOGGER_FLUSH_LOG		_IO(__LOGGERIO, 4) /* flush log */
+/* position of a reader of the mapping */
+#define LOGGER_SET_READ_POS		_IOW(__LOGGERIO, 5, struct logger_read_pos)
 
 #endif /* _LINUX_LOGGER_H */
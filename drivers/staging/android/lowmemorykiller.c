@@ -17,6 +17,25 @@
  * percentage of the cached memory is locked this can be very inaccurate
  * and processes may not get killed until the normal oom killer is triggered.
  *
+ * In pressure mode (write 1 to /sys/module/lowmemorykiller/parameters/pressure)
+ * the driver also kills ahead of the minfree thresholds, when reclaim stops
+ * being efficient: every pressure_interval ms, the share of the pages vmscan
+ * scanned that it could not reclaim, or the number of allocations stalled in
+ * direct reclaim against pressure_stalls, gives a pressure from 0 to 100.
+ * Reaching pressure_high kills a process of the highest adj level; if the
+ * pressure is still that high pressure_holdoff ms later, the next level is
+ * used, down to the second one. The levels start from the highest again
+ * once the pressure has dropped under pressure_low. The first (foreground)
+ * level is only ever killed from by the minfree thresholds.
+ *
+ * In memcg mode (write 1 to /sys/module/lowmemorykiller/parameters/memcg) a
+ * memory cgroup that has reached its limit is treated like the whole system:
+ * the minfree thresholds, scaled down by the share of RAM its limit is, are
+ * checked against how much more it can be charged with and how much of it is
+ * page cache, and the process killed is picked among its own. One group of
+ * processes running into its limit then does not cost processes outside it,
+ * and does not have to wait for the memcg OOM killer.
+ *
  * Copyright (C) 2007-2008 Google, Inc.
  *
  * This software is licensed under the terms of the GNU General Public
@@ -38,6 +57,14 @@
 #include <linux/rcupdate.h>
 #include <linux/profile.h>
 #include <linux/notifier.h>
+#include <linux/spinlock.h>
+#include <linux/vmstat.h>
+#include <linux/workqueue.h>
+#include <linux/memcontrol.h>
+#include <linux/swap.h>
+
+#define CREATE_TRACE_POINTS
+#include "lowmemorykiller_trace.h"
 
 static uint32_t lowmem_debug_level = 2;
 static int lowmem_adj[6] = {
@@ -58,12 +85,91 @@ static int lowmem_minfree_size = 4;
 static struct task_struct *lowmem_deathpending;
 static unsigned long lowmem_deathpending_timeout;
 
+static bool lowmem_pressure;
+static unsigned int lowmem_pressure_interval = 100;	/* ms */
+static unsigned int lowmem_pressure_high = 90;
+static unsigned int lowmem_pressure_low = 60;
+static unsigned int lowmem_pressure_stalls = 64;	/* per interval */
+static unsigned int lowmem_pressure_min_scan = 512;	/* pages */
+static unsigned int lowmem_pressure_holdoff = 1000;	/* ms */
+
+#ifdef CONFIG_CGROUP_MEM_RES_CTLR
+static bool lowmem_memcg;
+#endif
+
 #define lowmem_print(level, x...)			\
 	do {						\
 		if (lowmem_debug_level >= (level))	\
 			printk(x);			\
 	} while (0)
 
+/*
+ * Thread groups are kept, by their signal_struct, in buckets of
+ * 1 << LOWMEM_BUCKET_SHIFT consecutive oom_score_adj values from fork to
+ * release, see include/linux/oom.h. Victims are looked for in the highest
+ * non-empty buckets only, instead of among all processes.
+ *
+ * The buckets are protected by lowmem_bucket_lock, which nests inside
+ * tasklist_lock and siglock. A signal_struct, like its tasks, is only freed
+ * an RCU grace period after its group left its bucket: what has been seen
+ * in a bucket under rcu_read_lock() can be looked at after dropping the lock.
+ */
+#define LOWMEM_BUCKET_SHIFT	6
+#define LOWMEM_NR_BUCKETS	\
+	(((OOM_SCORE_ADJ_MAX - OOM_SCORE_ADJ_MIN) >> LOWMEM_BUCKET_SHIFT) + 1)
+
+/* processes of equal oom_score_adj weighed against each other per pass */
+#define LOWMEM_SCAN_MAX		32
+
+static struct hlist_head lowmem_buckets[LOWMEM_NR_BUCKETS];
+static DEFINE_SPINLOCK(lowmem_bucket_lock);
+
+static inline int lowmem_bucket_index(int oom_score_adj)
+{
+	return (oom_score_adj - OOM_SCORE_ADJ_MIN) >> LOWMEM_BUCKET_SHIFT;
+}
+
+static inline struct hlist_head *lowmem_bucket(int oom_score_adj)
+{
+	return &lowmem_buckets[lowmem_bucket_index(oom_score_adj)];
+}
+
+/* Called with tasklist_lock held for writing, for a new thread group */
+void lowmem_add_task(struct task_struct *p)
+{
+	struct signal_struct *sig = p->signal;
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_bucket_lock, flags);
+	hlist_add_head(&sig->lowmem_node, lowmem_bucket(sig->oom_score_adj));
+	spin_unlock_irqrestore(&lowmem_bucket_lock, flags);
+}
+
+/* Called with tasklist_lock held for writing, as a thread group dies */
+void lowmem_del_task(struct task_struct *p)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_bucket_lock, flags);
+	hlist_del_init(&p->signal->lowmem_node);
+	spin_unlock_irqrestore(&lowmem_bucket_lock, flags);
+}
+
+/* Called with siglock held, after p->signal->oom_score_adj changed */
+void lowmem_update_adj(struct task_struct *p)
+{
+	struct signal_struct *sig = p->signal;
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_bucket_lock, flags);
+	if (!hlist_unhashed(&sig->lowmem_node)) {
+		hlist_del(&sig->lowmem_node);
+		hlist_add_head(&sig->lowmem_node,
+			       lowmem_bucket(sig->oom_score_adj));
+	}
+	spin_unlock_irqrestore(&lowmem_bucket_lock, flags);
+}
+
 static int
 task_notify_func(struct notifier_block *self, unsigned long val, void *data);
 
@@ -82,16 +188,157 @@ task_notify_func(struct notifier_block *self, unsigned long val, void *data)
 	return NOTIFY_OK;
 }
 
-static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
+/*
+ * lowmem_select - picks, among the processes with an oom_score_adj of at
+ * least 'min_score_adj', one of the highest oom_score_adj and of these the
+ * biggest, LOWMEM_SCAN_MAX of them at a time. Only processes charged to
+ * 'memcg' or below are considered, unless it is NULL. Returns it with its
+ * size and oom_score_adj in '*tasksize' and '*adj', or NULL. '*scanned'
+ * counts the processes looked at.
+ *
+ * Caller must hold rcu_read_lock().
+ */
+static struct task_struct *lowmem_select(int min_score_adj,
+					 struct mem_cgroup *memcg,
+					 int *tasksize, int *adj, int *scanned)
 {
-	struct task_struct *tsk;
+	struct signal_struct *cand[LOWMEM_SCAN_MAX];
+	struct signal_struct *sig;
+	struct hlist_node *node;
 	struct task_struct *selected = NULL;
+	int b = lowmem_bucket_index(OOM_SCORE_ADJ_MAX);
+	int ceil = OOM_SCORE_ADJ_MAX;
+	int skip = 0;
+	int best, seen, i, n;
+
+	*tasksize = 0;
+	*scanned = 0;
+	while (b >= lowmem_bucket_index(min_score_adj)) {
+		/*
+		 * the highest oom_score_adj up to 'ceil' in this bucket,
+		 * past the 'skip' processes of it already weighed
+		 */
+		n = 0;
+		seen = 0;
+		best = min_score_adj;
+		spin_lock_irq(&lowmem_bucket_lock);
+		hlist_for_each_entry(sig, node, &lowmem_buckets[b],
+				     lowmem_node) {
+			int oom_score_adj = sig->oom_score_adj;
+
+			(*scanned)++;
+			if (oom_score_adj < best || oom_score_adj > ceil)
+				continue;
+			if (oom_score_adj > best) {
+				best = oom_score_adj;
+				n = 0;
+				seen = 0;
+			}
+			if (seen++ < skip)
+				continue;
+			if (n < LOWMEM_SCAN_MAX)
+				cand[n++] = sig;
+		}
+		spin_unlock_irq(&lowmem_bucket_lock);
+
+		if (!n) {
+			if (skip) {
+				/* all of this oom_score_adj weighed */
+				ceil = best - 1;
+				skip = 0;
+			} else {
+				b--;
+				ceil = OOM_SCORE_ADJ_MAX;
+			}
+			continue;
+		}
+
+		for (i = 0; i < n; i++) {
+			struct task_struct *tsk, *p;
+			int size;
+
+			tsk = pid_task(cand[i]->leader_pid, PIDTYPE_PID);
+			if (!tsk || (tsk->flags & PF_KTHREAD))
+				continue;
+			if (memcg && !task_in_mem_cgroup(tsk, memcg))
+				continue;
+
+			p = find_lock_task_mm(tsk);
+			if (!p)
+				continue;
+			size = get_mm_rss(p->mm);
+			task_unlock(p);
+			if (size <= 0 || size <= *tasksize)
+				continue;
+
+			selected = p;
+			*tasksize = size;
+			*adj = best;
+			lowmem_print(2, "select %d (%s), adj %d, size %d, "
+				     "to kill\n", p->pid, p->comm, best, size);
+		}
+		if (selected)
+			break;
+
+		/* none of them would do, try the next ones */
+		if (seen > skip + n) {
+			ceil = best;
+			skip += n;
+		} else {
+			ceil = best - 1;
+			skip = 0;
+		}
+	}
+
+	return selected;
+}
+
+/*
+ * lowmem_kill - kills the process lowmem_select() picks for 'min_score_adj'
+ * and 'memcg'. Returns its size, 0 if there was none to kill.
+ */
+static int lowmem_kill(int min_score_adj, struct mem_cgroup *memcg)
+{
+	struct task_struct *selected;
+	int selected_tasksize;
+	int selected_oom_score_adj;
+	int scanned;
+	u64 start;
+
+	start = local_clock();
+	rcu_read_lock();
+	selected = lowmem_select(min_score_adj, memcg, &selected_tasksize,
+				 &selected_oom_score_adj, &scanned);
+	trace_lowmem_select(selected, selected ? selected_oom_score_adj : 0,
+			    selected_tasksize, min_score_adj, scanned,
+			    local_clock() - start);
+	if (!selected) {
+		rcu_read_unlock();
+		return 0;
+	}
+
+	lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
+		     selected->pid, selected->comm,
+		     selected_oom_score_adj, selected_tasksize);
+	/*
+	 * If CONFIG_PROFILING is off, then we don't want to stall
+	 * the killer by setting lowmem_deathpending.
+	 */
+#ifdef CONFIG_PROFILING
+	lowmem_deathpending = selected;
+	lowmem_deathpending_timeout = jiffies + HZ;
+#endif
+	send_sig(SIGKILL, selected, 0);
+	rcu_read_unlock();
+
+	return selected_tasksize;
+}
+
+static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
+{
 	int rem = 0;
-	int tasksize;
 	int i;
 	int min_score_adj = OOM_SCORE_ADJ_MAX + 1;
-	int selected_tasksize = 0;
-	int selected_oom_score_adj;
 	int array_size = ARRAY_SIZE(lowmem_adj);
 	int other_free = global_page_state(NR_FREE_PAGES);
 	int other_file = global_page_state(NR_FILE_PAGES) -
@@ -134,77 +381,201 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 			     sc->nr_to_scan, sc->gfp_mask, rem);
 		return rem;
 	}
-	selected_oom_score_adj = min_score_adj;
+	if (min_score_adj < OOM_SCORE_ADJ_MIN)
+		min_score_adj = OOM_SCORE_ADJ_MIN;
 
-	rcu_read_lock();
-	for_each_process(tsk) {
-		struct task_struct *p;
-		int oom_score_adj;
+	rem -= lowmem_kill(min_score_adj, NULL);
+	lowmem_print(4, "lowmem_shrink %lu, %x, return %d\n",
+		     sc->nr_to_scan, sc->gfp_mask, rem);
+	return rem;
+}
 
-		if (tsk->flags & PF_KTHREAD)
-			continue;
+static struct shrinker lowmem_shrinker = {
+	.shrink = lowmem_shrink,
+	.seeks = DEFAULT_SEEKS * 16
+};
 
-		p = find_lock_task_mm(tsk);
-		if (!p)
-			continue;
+#ifdef CONFIG_CGROUP_MEM_RES_CTLR
+/*
+ * Called by a task charging 'memcg' beyond its limit, before reclaiming from
+ * it, see mem_cgroup_do_charge().
+ */
+void lowmem_memcg_limit(struct mem_cgroup *memcg)
+{
+	unsigned long limit, margin, cache;
+	int min_score_adj = OOM_SCORE_ADJ_MAX + 1;
+	int array_size = ARRAY_SIZE(lowmem_adj);
+	int i;
 
-		oom_score_adj = p->signal->oom_score_adj;
-		if (oom_score_adj < min_score_adj) {
-			task_unlock(p);
-			continue;
-		}
-		tasksize = get_mm_rss(p->mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (oom_score_adj < selected_oom_score_adj)
-				continue;
-			if (oom_score_adj == selected_oom_score_adj &&
-			    tasksize <= selected_tasksize)
-				continue;
+	if (!lowmem_memcg)
+		return;
+	if (lowmem_deathpending &&
+	    time_before_eq(jiffies, lowmem_deathpending_timeout))
+		return;
+
+	mem_cgroup_lowmem_stat(memcg, &limit, &margin, &cache);
+	limit = min(limit, totalram_pages);
+
+	if (lowmem_adj_size < array_size)
+		array_size = lowmem_adj_size;
+	if (lowmem_minfree_size < array_size)
+		array_size = lowmem_minfree_size;
+	for (i = 0; i < array_size; i++) {
+		unsigned long minfree = (u64)lowmem_minfree[i] * limit /
+					totalram_pages;
+
+		if (margin < minfree && cache < minfree) {
+			min_score_adj = lowmem_adj[i];
+			break;
 		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_score_adj = oom_score_adj;
-		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-			     p->pid, p->comm, oom_score_adj, tasksize);
 	}
-	if (selected) {
-		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
-			     selected->pid, selected->comm,
-			     selected_oom_score_adj, selected_tasksize);
-		/*
-		 * If CONFIG_PROFILING is off, then we don't want to stall
-		 * the killer by setting lowmem_deathpending.
-		 */
-#ifdef CONFIG_PROFILING
-		lowmem_deathpending = selected;
-		lowmem_deathpending_timeout = jiffies + HZ;
+	lowmem_print(3, "lowmem_memcg_limit limit %lu, margin %lu, "
+		     "cache %lu, ma %d\n", limit, margin, cache,
+		     min_score_adj);
+	if (min_score_adj == OOM_SCORE_ADJ_MAX + 1)
+		return;
+
+	lowmem_kill(max(min_score_adj, OOM_SCORE_ADJ_MIN), memcg);
+}
 #endif
-		send_sig(SIGKILL, selected, 0);
-		rem -= selected_tasksize;
+
+static void lowmem_pressure_fn(struct work_struct *work);
+/* deferrable: an idle system is under no pressure */
+static DECLARE_DEFERRED_WORK(lowmem_pressure_work, lowmem_pressure_fn);
+static bool lowmem_initialized;
+
+/* reclaim counters at the previous sample, 'valid' once there has been one */
+static struct {
+	unsigned long scanned;
+	unsigned long reclaimed;
+	unsigned long stalls;
+	bool valid;
+} lowmem_vmscan;
+
+static int lowmem_pressure_step;
+static unsigned long lowmem_pressure_next;
+
+/*
+ * lowmem_pressure_sample - returns the pressure since the previous sample,
+ * from 0 to 100, or -1 if there was no previous sample.
+ */
+static int lowmem_pressure_sample(void)
+{
+	unsigned long events[NR_VM_EVENT_ITEMS];
+	unsigned long scanned = 0, reclaimed = 0, stalls;
+	unsigned long d_scanned, d_reclaimed, d_stalls;
+	int pressure = 0;
+	int i;
+
+	memset(events, 0, sizeof(events));
+	all_vm_events(events);
+	for (i = 0; i < MAX_NR_ZONES; i++) {
+		scanned += events[PGSCAN_KSWAPD_NORMAL - ZONE_NORMAL + i] +
+			   events[PGSCAN_DIRECT_NORMAL - ZONE_NORMAL + i];
+		reclaimed += events[PGSTEAL_NORMAL - ZONE_NORMAL + i];
 	}
-	lowmem_print(4, "lowmem_shrink %lu, %x, return %d\n",
-		     sc->nr_to_scan, sc->gfp_mask, rem);
-	rcu_read_unlock();
-	return rem;
+	stalls = events[ALLOCSTALL];
+
+	d_scanned = scanned - lowmem_vmscan.scanned;
+	d_reclaimed = reclaimed - lowmem_vmscan.reclaimed;
+	d_stalls = stalls - lowmem_vmscan.stalls;
+	lowmem_vmscan.scanned = scanned;
+	lowmem_vmscan.reclaimed = reclaimed;
+	lowmem_vmscan.stalls = stalls;
+	if (!lowmem_vmscan.valid) {
+		lowmem_vmscan.valid = true;
+		return -1;
+	}
+
+	if (d_scanned >= lowmem_pressure_min_scan && d_scanned > d_reclaimed)
+		pressure = 100 - d_reclaimed * 100 / d_scanned;
+	if (lowmem_pressure_stalls &&
+	    d_stalls * 100 / lowmem_pressure_stalls > pressure)
+		pressure = min_t(unsigned long, 100,
+				 d_stalls * 100 / lowmem_pressure_stalls);
+
+	if (pressure)
+		lowmem_print(3, "lowmem_pressure %d, scanned %lu, "
+			     "reclaimed %lu, stalls %lu\n", pressure,
+			     d_scanned, d_reclaimed, d_stalls);
+	return pressure;
 }
 
-static struct shrinker lowmem_shrinker = {
-	.shrink = lowmem_shrink,
-	.seeks = DEFAULT_SEEKS * 16
+static void lowmem_pressure_fn(struct work_struct *work)
+{
+	int array_size = ARRAY_SIZE(lowmem_adj);
+	int pressure, i;
+
+	if (!lowmem_pressure) {
+		lowmem_vmscan.valid = false;
+		return;
+	}
+
+	pressure = lowmem_pressure_sample();
+	if (pressure < 0)
+		goto out;
+
+	/* hysteresis: back to the highest level only once well relieved */
+	if (pressure < lowmem_pressure_low)
+		lowmem_pressure_step = 0;
+	if (pressure < lowmem_pressure_high)
+		goto out;
+
+	/* and never more than one kill per holdoff */
+	if (time_before(jiffies, lowmem_pressure_next))
+		goto out;
+	if (lowmem_deathpending &&
+	    time_before_eq(jiffies, lowmem_deathpending_timeout))
+		goto out;
+
+	if (lowmem_adj_size < array_size)
+		array_size = lowmem_adj_size;
+	if (lowmem_minfree_size < array_size)
+		array_size = lowmem_minfree_size;
+	i = max(array_size - 1 - lowmem_pressure_step, 1);
+	if (i >= array_size)
+		goto out;
+
+	if (lowmem_kill(max(lowmem_adj[i], OOM_SCORE_ADJ_MIN), NULL)) {
+		lowmem_pressure_next = jiffies +
+			msecs_to_jiffies(lowmem_pressure_holdoff);
+		lowmem_pressure_step++;
+	}
+
+out:
+	schedule_delayed_work(&lowmem_pressure_work,
+			      msecs_to_jiffies(lowmem_pressure_interval));
+}
+
+static int lowmem_pressure_set(const char *val, const struct kernel_param *kp)
+{
+	int ret = param_set_bool(val, kp);
+
+	/* before lowmem_init(), it starts the work itself */
+	if (!ret && lowmem_pressure && lowmem_initialized)
+		schedule_delayed_work(&lowmem_pressure_work, 0);
+	return ret;
+}
+
+static struct kernel_param_ops lowmem_pressure_ops = {
+	.set = lowmem_pressure_set,
+	.get = param_get_bool,
 };
 
 static int __init lowmem_init(void)
 {
 	task_handoff_register(&task_nb);
 	register_shrinker(&lowmem_shrinker);
+	lowmem_initialized = true;
+	if (lowmem_pressure)
+		schedule_delayed_work(&lowmem_pressure_work, 0);
 	return 0;
 }
 
 static void __exit lowmem_exit(void)
 {
+	lowmem_pressure = false;
+	cancel_delayed_work_sync(&lowmem_pressure_work);
 	unregister_shrinker(&lowmem_shrinker);
 	task_handoff_unregister(&task_nb);
 }
@@ -215,6 +586,22 @@ module_param_array_named(adj, lowmem_adj, int, &lowmem_adj_size,
 module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
+module_param_cb(pressure, &lowmem_pressure_ops, &lowmem_pressure,
+		S_IRUGO | S_IWUSR);
+module_param_named(pressure_interval, lowmem_pressure_interval, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_named(pressure_high, lowmem_pressure_high, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_named(pressure_low, lowmem_pressure_low, uint, S_IRUGO | S_IWUSR);
+module_param_named(pressure_stalls, lowmem_pressure_stalls, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_named(pressure_min_scan, lowmem_pressure_min_scan, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_named(pressure_holdoff, lowmem_pressure_holdoff, uint,
+		   S_IRUGO | S_IWUSR);
+#ifdef CONFIG_CGROUP_MEM_RES_CTLR
+module_param_named(memcg, lowmem_memcg, bool, S_IRUGO | S_IWUSR);
+#endif
 
 module_init(lowmem_init);
 module_exit(lowmem_exit);
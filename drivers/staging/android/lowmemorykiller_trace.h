@@ -0,0 +1,67 @@
+/*
+ * lowmemorykiller_trace.h: tracepoints of the Android low memory killer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM lowmemorykiller
+
+#if !defined(_LOWMEMORYKILLER_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _LOWMEMORYKILLER_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/sched.h>
+
+/*
+ * A victim selection: 'pid' is 0 if none was found. 'scanned' counts the
+ * processes looked at in the buckets walked and 'cost_ns' the time it took.
+ */
+TRACE_EVENT(lowmem_select,
+	TP_PROTO(struct task_struct *victim, int adj, int tasksize,
+		 int min_score_adj, int scanned, u64 cost_ns),
+	TP_ARGS(victim, adj, tasksize, min_score_adj, scanned, cost_ns),
+
+	TP_STRUCT__entry(
+		__field(pid_t, pid)
+		__array(char, comm, TASK_COMM_LEN)
+		__field(int, adj)
+		__field(int, tasksize)
+		__field(int, min_score_adj)
+		__field(int, scanned)
+		__field(u64, cost_ns)
+	),
+
+	TP_fast_assign(
+		__entry->pid = victim ? victim->pid : 0;
+		if (victim)
+			memcpy(__entry->comm, victim->comm, TASK_COMM_LEN);
+		else
+			__entry->comm[0] = '\0';
+		__entry->adj = adj;
+		__entry->tasksize = tasksize;
+		__entry->min_score_adj = min_score_adj;
+		__entry->scanned = scanned;
+		__entry->cost_ns = cost_ns;
+	),
+
+	TP_printk("pid=%d comm=%s adj=%d size=%d min_adj=%d scanned=%d cost=%lluns",
+		__entry->pid, __entry->comm, __entry->adj, __entry->tasksize,
+		__entry->min_score_adj, __entry->scanned,
+		(unsigned long long)__entry->cost_ns)
+);
+
+#endif /* _LOWMEMORYKILLER_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH ../../drivers/staging/android
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE lowmemorykiller_trace
+
+#include <trace/define_trace.h>
@@ -17,62 +17,53 @@
  */
 #include <linux/sched.h>
 #include <linux/slab.h>
+#include <linux/hash.h>
+#include <linux/rculist.h>
 
 #include "msg_queue.h"
 
 
+#define QUEUE_HASH_BITS		10
+#define QUEUE_HASH_SIZE		(1 << QUEUE_HASH_BITS)
+
+
+/* Queues are looked up locklessly under RCU, g_queue_lock only serializes
+   insertion and removal. Ids are never reused, so a stale id simply misses. */
 static DEFINE_SPINLOCK(g_queue_lock);
-static struct rb_root g_queue_tree = RB_ROOT;
+static struct hlist_head g_queue_hash[QUEUE_HASH_SIZE];
 static msg_queue_id g_queue_seq;
 
 
-static inline void rb_insert_queue(struct msg_queue *new)
+static inline struct hlist_head *queue_hash_head(msg_queue_id id)
 {
-	struct rb_node *parent, **p;
-	struct msg_queue *q;
-	msg_queue_id id;
-
-retry:
-	id = ++g_queue_seq;
-	p = &g_queue_tree.rb_node;
-	parent = NULL;
-
-	while (*p) {
-		parent = *p;
-		q = container_of(parent, struct msg_queue, rb_node);
-
-		if (id < q->id)
-			p = &(*p)->rb_left;
-		else if (id > q->id)
-			p = &(*p)->rb_right;
-		else
-			goto retry;
-	}
-
-	new->id = id;
-	rb_link_node(&new->rb_node, parent, p);
-	rb_insert_color(&new->rb_node, &g_queue_tree);
+	return &g_queue_hash[hash_long(id, QUEUE_HASH_BITS)];
 }
 
-static inline struct msg_queue *rb_queue_exist(msg_queue_id id)
+static inline struct msg_queue *hash_queue_exist(msg_queue_id id)
 {
-	struct rb_node *n = g_queue_tree.rb_node;
+	struct hlist_node *node;
 	struct msg_queue *q;
 
-	while (n) {
-		q = container_of(n, struct msg_queue, rb_node);
-
-		if (id < q->id)
-			n = n->rb_left;
-		else if (id > q->id)
-			n = n->rb_right;
-		else
+	hlist_for_each_entry_rcu(q, node, queue_hash_head(id), hash_node) {
+		if (q->id == id)
 			return q;
 	}
 
 	return NULL;
 }
 
+static inline void hash_insert_queue(struct msg_queue *new)
+{
+	msg_queue_id id;
+
+	do {
+		id = ++g_queue_seq;
+	} while (!id || hash_queue_exist(id));
+
+	new->id = id;
+	hlist_add_head_rcu(&new->hash_node, queue_hash_head(id));
+}
+
 struct msg_queue *create_msg_queue(size_t max_msgs, queue_release_handler handler, void *data)
 {
 	struct msg_queue *q;
@@ -90,12 +81,12 @@ struct msg_queue *create_msg_queue(size_t max_msgs, queue_release_handler handle
 	init_waitqueue_head(&q->wr_wait);
 
 	q->active = 1;
-	q->usage = 1;
+	atomic_set(&q->usage, 1);
 	q->release = handler;
 	q->private = data;
 
 	spin_lock(&g_queue_lock);
-	rb_insert_queue(q);
+	hash_insert_queue(q);
 	spin_unlock(&g_queue_lock);
 	return q;
 }
@@ -110,40 +101,34 @@ struct msg_queue *get_msg_queue(msg_queue_id id)
 {
 	struct msg_queue *q;
 
-	spin_lock(&g_queue_lock);
-	if (!(q = rb_queue_exist(id))) {
-		spin_unlock(&g_queue_lock);
-		return NULL;
-	}
-
-	q->usage++;
-	spin_unlock(&g_queue_lock);
+	rcu_read_lock();
+	q = hash_queue_exist(id);
+	if (q && !atomic_inc_not_zero(&q->usage))
+		q = NULL;	// being released
+	rcu_read_unlock();
 
 	return q;
 }
 
 int put_msg_queue(struct msg_queue *q)
 {
-	spin_lock(&g_queue_lock);
-
-	if (--q->usage > 0) {
-		spin_unlock(&g_queue_lock);
+	if (!atomic_dec_and_test(&q->usage))
 		return 0;
-	}
 
-	rb_erase(&q->rb_node, &g_queue_tree);
+	spin_lock(&g_queue_lock);
+	hlist_del_rcu(&q->hash_node);
 	spin_unlock(&g_queue_lock);
 
 	BUG_ON(waitqueue_active(&q->rd_wait) || waitqueue_active(&q->wr_wait));
 
 	if (q->release)
 		q->release(q, q->private);
-	kfree(q);
+	kfree_rcu(q, rcu);
 
 	return 1;
 }
 
-static int _write_msg_queue(struct msg_queue *q, struct list_head *msg, int head)
+static int _write_msg_queue(struct msg_queue *q, struct list_head *msg, int head, int sync)
 {
 	DECLARE_WAITQUEUE(wait, current);
 	int r;
@@ -166,7 +151,12 @@ static int _write_msg_queue(struct msg_queue *q, struct list_head *msg, int head
 			q->num_msgs++;
 			spin_unlock(&q->lock);
 
-			wake_up(&q->rd_wait);
+			/* a sync wakeup tells the scheduler we're about to sleep, so the
+			   reader is woken on this CPU rather than migrated elsewhere */
+			if (sync)
+				wake_up_interruptible_sync(&q->rd_wait);
+			else
+				wake_up(&q->rd_wait);
 			r = 0;
 			break;
 		}
@@ -187,12 +177,17 @@ static int _write_msg_queue(struct msg_queue *q, struct list_head *msg, int head
 
 int write_msg_queue(struct msg_queue *q, struct list_head *msg)
 {
-	return _write_msg_queue(q, msg, 0);
+	return _write_msg_queue(q, msg, 0, 0);
+}
+
+int write_msg_queue_sync(struct msg_queue *q, struct list_head *msg)
+{
+	return _write_msg_queue(q, msg, 0, 1);
 }
 
 int write_msg_queue_head(struct msg_queue *q, struct list_head *msg)
 {
-	return _write_msg_queue(q, msg, 1);
+	return _write_msg_queue(q, msg, 1, 0);
 }
 
 static int _read_msg_queue(struct msg_queue *q, struct list_head **pmsg, int tail)
@@ -251,3 +246,120 @@ int read_msg_queue_tail(struct msg_queue *q, struct list_head **pmsg)
 {
 	return _read_msg_queue(q, pmsg, 1);
 }
+
+/* Splice 'n' messages from 'msgs' to the end of the queue, once it's not full. The whole list
+   is moved in one go, so the queue may temporarily grow up to n - 1 messages over its limit. */
+int write_msg_queue_list(struct msg_queue *q, struct list_head *msgs, size_t n)
+{
+	DECLARE_WAITQUEUE(wait, current);
+	int r;
+
+	if (!n)
+		return 0;
+
+	add_wait_queue(&q->wr_wait, &wait);
+	do {
+		set_current_state(TASK_INTERRUPTIBLE);
+
+		if (!q->active) {
+			r = -EIO;
+			break;
+		}
+
+		spin_lock(&q->lock);
+		if (q->num_msgs < q->max_msgs) {
+			list_splice_tail_init(msgs, &q->msgs);
+			q->num_msgs += n;
+			spin_unlock(&q->lock);
+
+			wake_up(&q->rd_wait);
+			r = 0;
+			break;
+		}
+		spin_unlock(&q->lock);
+
+		if (signal_pending(current)) {
+			r = -ERESTARTSYS;
+			break;
+		}
+		schedule();
+	} while (1);
+
+	__set_current_state(TASK_RUNNING);
+	remove_wait_queue(&q->wr_wait, &wait);
+
+	return r;
+}
+
+/* Put messages previously taken off by read_msg_queue_list() back to the front of the queue.
+   It never blocks on a full queue, as the messages were just occupying their slots. */
+int write_msg_queue_list_head(struct msg_queue *q, struct list_head *msgs, size_t n)
+{
+	if (!n)
+		return 0;
+
+	if (!q->active)
+		return -EIO;
+
+	spin_lock(&q->lock);
+	list_splice_init(msgs, &q->msgs);
+	q->num_msgs += n;
+	spin_unlock(&q->lock);
+
+	wake_up(&q->rd_wait);
+	return 0;
+}
+
+/* Wait for the queue to become non-empty and move up to 'max_msgs' messages from its front to
+   the end of 'msgs'. Returns the number of messages moved. */
+int read_msg_queue_list(struct msg_queue *q, struct list_head *msgs, size_t max_msgs)
+{
+	struct list_head *entry;
+	DECLARE_WAITQUEUE(wait, current);
+	size_t n;
+	int r;
+
+	add_wait_queue(&q->rd_wait, &wait);
+	do {
+		set_current_state(TASK_INTERRUPTIBLE);
+
+		if (!q->active) {
+			r = -EIO;
+			break;
+		}
+
+		spin_lock(&q->lock);
+		if (q->num_msgs > 0) {
+			if (q->num_msgs <= max_msgs) {
+				n = q->num_msgs;
+				list_splice_tail_init(&q->msgs, msgs);
+			} else {
+				LIST_HEAD(front);
+
+				for (n = 0, entry = &q->msgs; n < max_msgs; n++)
+					entry = entry->next;
+
+				list_cut_position(&front, &q->msgs, entry);
+				list_splice_tail(&front, msgs);
+			}
+			q->num_msgs -= n;
+			spin_unlock(&q->lock);
+
+			wake_up(&q->wr_wait);
+			r = n;
+			break;
+		}
+		spin_unlock(&q->lock);
+
+		if (signal_pending(current)) {
+			r = -ERESTARTSYS;
+			break;
+		}
+		schedule();
+	} while (1);
+
+	__set_current_state(TASK_RUNNING);
+	remove_wait_queue(&q->rd_wait, &wait);
+
+	return r;
+}
@@ -21,10 +21,12 @@
 #include <linux/types.h>
 #include <linux/spinlock.h>
 #include <linux/list.h>
-#include <linux/rbtree.h>
+#include <linux/rcupdate.h>
 #include <linux/wait.h>
 #include <linux/poll.h>
 
+#include <asm/atomic.h>
+
 
 #define DEFAULT_MAX_QUEUE_LENGTH		100
 
@@ -47,8 +49,9 @@ struct msg_queue {
 	wait_queue_head_t rd_wait;
 	wait_queue_head_t wr_wait;
 
-	struct rb_node rb_node;
-	int usage; 
+	struct hlist_node hash_node;
+	atomic_t usage;
+	struct rcu_head rcu;
 
 	queue_release_handler release;
 	void *private;
@@ -62,11 +65,17 @@ extern struct msg_queue *get_msg_queue(msg_queue_id id);
 extern int put_msg_queue(struct msg_queue *q);
 
 extern int write_msg_queue(struct msg_queue *q, struct list_head *msg);
+extern int write_msg_queue_sync(struct msg_queue *q, struct list_head *msg);	// writer is going to wait
 extern int write_msg_queue_head(struct msg_queue *q, struct list_head *msg);
 
 extern int read_msg_queue(struct msg_queue *q, struct list_head **pmsg);
 extern int read_msg_queue_tail(struct msg_queue *q, struct list_head **pmsg);
 
+/* Batched versions, moving a whole list of messages under a single lock hold and wakeup */
+extern int write_msg_queue_list(struct msg_queue *q, struct list_head *msgs, size_t n);
+extern int write_msg_queue_list_head(struct msg_queue *q, struct list_head *msgs, size_t n);
+extern int read_msg_queue_list(struct msg_queue *q, struct list_head *msgs, size_t max_msgs);
+
 
 #define msg_queue_id(q)		(q)->id
 
@@ -18,11 +18,17 @@
 #include <linux/kernel.h>
 #include <linux/init.h>
 #include <linux/io.h>
+#include <linux/hrtimer.h>
+#include <linux/kmsg_dump.h>
 #include <linux/list.h>
 #include <linux/memblock.h>
+#include <linux/notifier.h>
+#include <linux/reboot.h>
 #include <linux/rslib.h>
 #include <linux/slab.h>
+#include <linux/sort.h>
 #include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 #include "persistent_ram.h"
 
 struct persistent_ram_buffer {
@@ -34,6 +40,14 @@ struct persistent_ram_buffer {
 
 #define PERSISTENT_RAM_SIG (0x43474244) /* DBGC */
 
+/*
+ * Writes only mark the ECC blocks they touch dirty, the parity is brought up
+ * to date by a work item this long after. Whatever is written in between is
+ * not protected. From a reboot or panic on, blocks are encoded as they are
+ * written. The header is always encoded with each write.
+ */
+#define PERSISTENT_RAM_ECC_DELAY	msecs_to_jiffies(10)
+
 static __initdata LIST_HEAD(persistent_ram_list);
 
 static inline size_t buffer_size(struct persistent_ram_zone *prz)
@@ -96,17 +110,53 @@ static inline ssize_t buffer_size_add_clamp(struct persistent_ram_zone *prz,
 	return 0;
 }
 
+/*
+ * Same parity as encode_rs8(), but with the contribution of every possible
+ * feedback byte to all of the parity bytes taken from prz->ecc_table, so
+ * each data byte only costs a row of XORs.
+ */
 static void notrace persistent_ram_encode_rs8(struct persistent_ram_zone *prz,
 	uint8_t *data, size_t len, uint8_t *ecc)
 {
-	int i;
-	uint16_t par[prz->ecc_size];
+	int ecc_size = prz->ecc_size;
+	uint8_t buf[prz->ecc_block_size];
+	uint8_t par[ecc_size];
+	const uint8_t *t;
+	size_t i;
+	int j;
+
+	/* the buffer is uncached, read it in one go */
+	if (len <= sizeof(buf)) {
+		memcpy(buf, data, len);
+		data = buf;
+	}
 
-	/* Initialize the parity buffer */
 	memset(par, 0, sizeof(par));
-	encode_rs8(prz->rs_decoder, data, len, par, 0);
-	for (i = 0; i < prz->ecc_size; i++)
-		ecc[i] = par[i];
+	for (i = 0; i < len; i++) {
+		t = prz->ecc_table + (data[i] ^ par[0]) * ecc_size;
+		for (j = 0; j < ecc_size - 1; j++)
+			par[j] = par[j + 1] ^ t[j];
+		par[ecc_size - 1] = t[ecc_size - 1];
+	}
+	memcpy(ecc, par, ecc_size);
+}
+
+static int persistent_ram_init_ecc_table(struct persistent_ram_zone *prz)
+{
+	struct rs_control *rs = prz->rs_decoder;
+	int nroots = prz->ecc_size;
+	int fb, k;
+
+	prz->ecc_table = kzalloc(256 * nroots, GFP_KERNEL);
+	if (!prz->ecc_table)
+		return -ENOMEM;
+
+	for (fb = 1; fb < 256; fb++)
+		for (k = 0; k < nroots; k++)
+			prz->ecc_table[fb * nroots + k] =
+				rs->alpha_to[rs_modnn(rs, rs->index_of[fb] +
+						rs->genpoly[nroots - 1 - k])];
+	return 0;
 }
 
 static int persistent_ram_decode_rs8(struct persistent_ram_zone *prz,
@@ -121,33 +171,49 @@ static int persistent_ram_decode_rs8(struct persistent_ram_zone *prz,
 				NULL, 0, NULL, 0, NULL);
 }
 
+static void notrace persistent_ram_encode_block(struct persistent_ram_zone *prz,
+	int i)
+{
+	int ecc_block_size = prz->ecc_block_size;
+	int size = min_t(size_t, ecc_block_size,
+			 prz->buffer_size - i * ecc_block_size);
+
+	persistent_ram_encode_rs8(prz, prz->buffer->data + i * ecc_block_size,
+				  size, prz->par_buffer + i * prz->ecc_size);
+}
+
+/* marks the blocks of [start, start + count) dirty, the data being written */
 static void notrace persistent_ram_update_ecc(struct persistent_ram_zone *prz,
 	unsigned int start, unsigned int count)
 {
-	struct persistent_ram_buffer *buffer = prz->buffer;
-	uint8_t *buffer_end = buffer->data + prz->buffer_size;
-	uint8_t *block;
-	uint8_t *par;
 	int ecc_block_size = prz->ecc_block_size;
-	int ecc_size = prz->ecc_size;
-	int size = prz->ecc_block_size;
+	int first, last;
 
-	if (!prz->ecc)
+	if (!prz->ecc || !count)
 		return;
 
-	block = buffer->data + (start & ~(ecc_block_size - 1));
-	par = prz->par_buffer + (start / ecc_block_size) * prz->ecc_size;
+	first = start / ecc_block_size;
+	last = (start + count - 1) / ecc_block_size;
 
-	do {
-		if (block + ecc_block_size > buffer_end)
-			size = buffer_end - block;
-		persistent_ram_encode_rs8(prz, block, size, par);
-		block += ecc_block_size;
-		par += ecc_size;
-	} while (block < buffer->data + start + count);
+	if (unlikely(ACCESS_ONCE(prz->ecc_sync))) {
+		for (; first <= last; first++)
+			persistent_ram_encode_block(prz, first);
+		return;
+	}
+
+	smp_wmb();
+	for (; first <= last; first++)
+		set_bit(first, prz->ecc_dirty);
+	if (!delayed_work_pending(&prz->ecc_work))
+		schedule_delayed_work(&prz->ecc_work, PERSISTENT_RAM_ECC_DELAY);
 }
 
-static void persistent_ram_update_header_ecc(struct persistent_ram_zone *prz)
+/*
+ * Stale parity of the header would have start and size "corrected" back to
+ * what they were at the last flush on the next boot, dropping all the lines
+ * written since, so it is never deferred.
+ */
+static void notrace persistent_ram_update_header_ecc(struct persistent_ram_zone *prz)
 {
 	struct persistent_ram_buffer *buffer = prz->buffer;
 
@@ -158,6 +224,87 @@ static void persistent_ram_update_header_ecc(struct persistent_ram_zone *prz)
 				  prz->par_header);
 }
 
+/*
+ * Encodes every dirty block once. A block is written again after its bit is
+ * cleared only if it has been dirtied again since, and is then encoded by
+ * the next flush.
+ */
+static void notrace persistent_ram_flush_ecc(struct persistent_ram_zone *prz)
+{
+	int i;
+
+	for_each_set_bit(i, prz->ecc_dirty, prz->ecc_blocks) {
+		if (test_and_clear_bit(i, prz->ecc_dirty))
+			persistent_ram_encode_block(prz, i);
+	}
+}
+
+static void persistent_ram_ecc_work(struct work_struct *work)
+{
+	struct persistent_ram_zone *prz =
+		container_of(work, struct persistent_ram_zone, ecc_work.work);
+
+	/* the work may run on two cpus at once */
+	spin_lock(&prz->ecc_lock);
+	persistent_ram_flush_ecc(prz);
+	spin_unlock(&prz->ecc_lock);
+}
+
+/*
+ * Switches to encoding blocks as they are written, then encodes those still
+ * dirty. On a panic the other cpus may be stopped with the lock held, don't
+ * wait for it.
+ */
+static void persistent_ram_ecc_sync(struct persistent_ram_zone *prz,
+	bool panic)
+{
+	int locked = 1;
+
+	prz->ecc_sync = true;
+	smp_mb();
+
+	if (panic)
+		locked = spin_trylock(&prz->ecc_lock);
+	else
+		spin_lock(&prz->ecc_lock);
+	persistent_ram_flush_ecc(prz);
+	if (locked)
+		spin_unlock(&prz->ecc_lock);
+}
+
+/*
+ * Runs after the last lines of a panic, and of a restart, halt or power off
+ * with printk.always_kmsg_dump set.
+ */
+static void persistent_ram_ecc_dump(struct kmsg_dumper *dumper,
+	enum kmsg_dump_reason reason, const char *s1, unsigned long l1,
+	const char *s2, unsigned long l2)
+{
+	struct persistent_ram_zone *prz =
+		container_of(dumper, struct persistent_ram_zone, ecc_dumper);
+
+	if (reason == KMSG_DUMP_OOPS)
+		return;
+
+	persistent_ram_ecc_sync(prz, reason == KMSG_DUMP_PANIC ||
+				     reason == KMSG_DUMP_EMERG);
+}
+
+/*
+ * Without printk.always_kmsg_dump there is no dump on a reboot, the lines
+ * written from here on are encoded as they are written instead.
+ */
+static int persistent_ram_ecc_reboot(struct notifier_block *nb,
+	unsigned long event, void *unused)
+{
+	struct persistent_ram_zone *prz =
+		container_of(nb, struct persistent_ram_zone, ecc_reboot_nb);
+
+	persistent_ram_ecc_sync(prz, false);
+
+	return NOTIFY_DONE;
+}
+
 static void persistent_ram_ecc_old(struct persistent_ram_zone *prz)
 {
 	struct persistent_ram_buffer *buffer = prz->buffer;
@@ -227,6 +374,23 @@ static int persistent_ram_init_ecc(struct persistent_ram_zone *prz,
 		return -EINVAL;
 	}
 
+	if (persistent_ram_init_ecc_table(prz))
+		return -ENOMEM;
+
+	prz->ecc_blocks = ecc_blocks;
+	prz->ecc_dirty = kzalloc(BITS_TO_LONGS(ecc_blocks) *
+				 sizeof(unsigned long), GFP_KERNEL);
+	if (!prz->ecc_dirty) {
+		kfree(prz->ecc_table);
+		return -ENOMEM;
+	}
+	spin_lock_init(&prz->ecc_lock);
+	INIT_DELAYED_WORK(&prz->ecc_work, persistent_ram_ecc_work);
+	prz->ecc_dumper.dump = persistent_ram_ecc_dump;
+	kmsg_dump_register(&prz->ecc_dumper);
+	prz->ecc_reboot_nb.notifier_call = persistent_ram_ecc_reboot;
+	register_reboot_notifier(&prz->ecc_reboot_nb);
+
 	prz->corrected_bytes = 0;
 	prz->bad_blocks = 0;
 
@@ -468,3 +632,103 @@ int __init persistent_ram_early_init(struct persistent_ram *ram)
 
 	return 0;
 }
+
+#ifdef CONFIG_ANDROID_PERSISTENT_RAM_BENCH
+#define PERSISTENT_RAM_BENCH_PAGES	32
+#define PERSISTENT_RAM_BENCH_WRITES	10000
+
+static int __init persistent_ram_bench_cmp(const void *a, const void *b)
+{
+	u32 x = *(const u32 *)a, y = *(const u32 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Writes console lines into a scratch zone mapped the way
+ * persistent_ram_buffer_map() maps the real ones, wrapping it several times,
+ * then flushes the ECC of all the blocks they dirtied.
+ */
+static int __init persistent_ram_bench(void)
+{
+	static const char line[] = "<6>[  123.456789] binder: 1234:1250 "
+		"transaction failed 29189, size 128-0\n";
+	struct persistent_ram_zone *prz;
+	struct page **pages;
+	unsigned long flags;
+	u64 total = 0, flush;
+	ktime_t start;
+	u32 *ns;
+	int i, ret = -ENOMEM;
+
+	prz = kzalloc(sizeof(*prz), GFP_KERNEL);
+	pages = kcalloc(PERSISTENT_RAM_BENCH_PAGES, sizeof(*pages), GFP_KERNEL);
+	ns = vmalloc(PERSISTENT_RAM_BENCH_WRITES * sizeof(*ns));
+	if (!prz || !pages || !ns)
+		goto out;
+
+	for (i = 0; i < PERSISTENT_RAM_BENCH_PAGES; i++) {
+		pages[i] = alloc_page(GFP_KERNEL | __GFP_ZERO);
+		if (!pages[i])
+			goto out;
+	}
+	prz->vaddr = vmap(pages, PERSISTENT_RAM_BENCH_PAGES, VM_MAP,
+			  pgprot_noncached(PAGE_KERNEL));
+	if (!prz->vaddr)
+		goto out;
+	prz->buffer = prz->vaddr;
+	prz->buffer_size = PERSISTENT_RAM_BENCH_PAGES * PAGE_SIZE -
+			   sizeof(struct persistent_ram_buffer);
+	prz->ecc = true;
+	ret = persistent_ram_init_ecc(prz, prz->buffer_size);
+	if (ret)
+		goto out;
+	prz->buffer->sig = PERSISTENT_RAM_SIG;
+
+	for (i = 0; i < PERSISTENT_RAM_BENCH_WRITES; i++) {
+		local_irq_save(flags);
+		start = ktime_get();
+		persistent_ram_write(prz, line, sizeof(line) - 1);
+		ns[i] = ktime_to_ns(ktime_sub(ktime_get(), start));
+		local_irq_restore(flags);
+		total += ns[i];
+	}
+
+	cancel_delayed_work_sync(&prz->ecc_work);
+	start = ktime_get();
+	persistent_ram_ecc_work(&prz->ecc_work.work);
+	flush = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	sort(ns, PERSISTENT_RAM_BENCH_WRITES, sizeof(*ns),
+	     persistent_ram_bench_cmp, NULL);
+	pr_info("persistent_ram: %d writes of %zu bytes with ecc: mean %llu ns,"
+		" p50 %u ns, p99 %u ns, max %u ns, ecc flush %llu us\n",
+		PERSISTENT_RAM_BENCH_WRITES, sizeof(line) - 1,
+		div_u64(total, PERSISTENT_RAM_BENCH_WRITES),
+		ns[PERSISTENT_RAM_BENCH_WRITES / 2],
+		ns[PERSISTENT_RAM_BENCH_WRITES * 99 / 100],
+		ns[PERSISTENT_RAM_BENCH_WRITES - 1], div_u64(flush, 1000));
+
+out:
+	if (prz && prz->ecc_dirty) {
+		unregister_reboot_notifier(&prz->ecc_reboot_nb);
+		kmsg_dump_unregister(&prz->ecc_dumper);
+		cancel_delayed_work_sync(&prz->ecc_work);
+		kfree(prz->ecc_dirty);
+		kfree(prz->ecc_table);
+	}
+	if (prz && prz->rs_decoder)
+		free_rs(prz->rs_decoder);
+	if (prz && prz->vaddr)
+		vunmap(prz->vaddr);
+	for (i = 0; pages && i < PERSISTENT_RAM_BENCH_PAGES; i++) {
+		if (pages[i])
+			__free_page(pages[i]);
+	}
+	kfree(pages);
+	vfree(ns);
+	kfree(prz);
+	return ret;
+}
+late_initcall(persistent_ram_bench);
+#endif
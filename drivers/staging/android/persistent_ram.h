@@ -17,8 +17,12 @@
 
 #include <linux/device.h>
 #include <linux/kernel.h>
+#include <linux/kmsg_dump.h>
 #include <linux/list.h>
+#include <linux/notifier.h>
+#include <linux/spinlock.h>
 #include <linux/types.h>
+#include <linux/workqueue.h>
 
 struct persistent_ram_buffer;
 
@@ -45,8 +49,8 @@ struct persistent_ram_zone {
 
 	/* ECC correction */
 	bool ecc;
-	char *par_buffer;
-	char *par_header;
+	uint8_t *par_buffer;
+	uint8_t *par_header;
 	struct rs_control *rs_decoder;
 	int corrected_bytes;
 	int bad_blocks;
@@ -54,6 +58,14 @@ struct persistent_ram_zone {
 	int ecc_size;
 	int ecc_symsize;
 	int ecc_poly;
+	int ecc_blocks;
+	uint8_t *ecc_table;
+	unsigned long *ecc_dirty;	/* one bit per block */
+	spinlock_t ecc_lock;
+	struct delayed_work ecc_work;
+	bool ecc_sync;			/* encode blocks as they are written */
+	struct kmsg_dumper ecc_dumper;
+	struct notifier_block ecc_reboot_nb;
 
 	char *old_log;
 	size_t old_log_size;
@@ -23,13 +23,19 @@
 #include <linux/kernel.h>
 #include <linux/bio.h>
 #include <linux/bitops.h>
+#include <linux/bit_spinlock.h>
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
 #include <linux/device.h>
+#include <linux/fs.h>
 #include <linux/genhd.h>
 #include <linux/highmem.h>
+#include <linux/cpumask.h>
+#include <linux/jhash.h>
+#include <linux/log2.h>
 #include <linux/slab.h>
-#include <linux/lzo.h>
+#include <linux/crypto.h>
+#include <linux/sched.h>
 #include <linux/string.h>
 #include <linux/vmalloc.h>
 
@@ -38,20 +44,12 @@
 /* Globals */
 static int zram_major;
 struct zram *zram_devices;
+/* reads of backing devices on behalf of zram_make_request() */
+static struct workqueue_struct *zram_bd_wq;
 
 /* Module params (documentation at end) */
 static unsigned int num_devices;
 
-static void zram_stat_inc(u32 *v)
-{
-	*v = *v + 1;
-}
-
-static void zram_stat_dec(u32 *v)
-{
-	*v = *v - 1;
-}
-
 static void zram_stat64_add(struct zram *zram, u64 *v, u64 inc)
 {
 	spin_lock(&zram->stat64_lock);
@@ -71,39 +69,334 @@ static void zram_stat64_inc(struct zram *zram, u64 *v)
 	zram_stat64_add(zram, v, 1);
 }
 
+/*
+ * The flags and size of a table entry are only changed with the entry
+ * locked. The lock bit lives in the same word: lockers spinning on it
+ * never change the word while it is held.
+ */
+static void zram_lock_table(struct zram *zram, u32 index)
+{
+	bit_spin_lock(ZRAM_ACCESS, &zram->table[index].value);
+}
+
+static void zram_unlock_table(struct zram *zram, u32 index)
+{
+	bit_spin_unlock(ZRAM_ACCESS, &zram->table[index].value);
+}
+
 static int zram_test_flag(struct zram *zram, u32 index,
 			enum zram_pageflags flag)
 {
-	return zram->table[index].flags & BIT(flag);
+	return zram->table[index].value & BIT(flag);
 }
 
 static void zram_set_flag(struct zram *zram, u32 index,
 			enum zram_pageflags flag)
 {
-	zram->table[index].flags |= BIT(flag);
+	zram->table[index].value |= BIT(flag);
 }
 
 static void zram_clear_flag(struct zram *zram, u32 index,
 			enum zram_pageflags flag)
 {
-	zram->table[index].flags &= ~BIT(flag);
+	zram->table[index].value &= ~BIT(flag);
+}
+
+static size_t zram_get_obj_size(struct zram *zram, u32 index)
+{
+	return zram->table[index].value & (BIT(ZRAM_FLAG_SHIFT) - 1);
+}
+
+static void zram_set_obj_size(struct zram *zram, u32 index, size_t size)
+{
+	unsigned long flags = zram->table[index].value >> ZRAM_FLAG_SHIFT;
+
+	zram->table[index].value = (flags << ZRAM_FLAG_SHIFT) | size;
+}
+
+enum comp_op {
+	ZRAM_COMPOP_COMPRESS,
+	ZRAM_COMPOP_DECOMPRESS
+};
+
+static int zram_comp_op(struct zram *zram, enum comp_op op,
+			const u8 *src, unsigned int slen,
+			u8 *dst, unsigned int *dlen)
+{
+	struct crypto_comp *tfm;
+	u64 start, ns;
+	int ret;
+
+	start = local_clock();
+	tfm = *per_cpu_ptr(zram->comp_tfms, get_cpu());
+	switch (op) {
+	case ZRAM_COMPOP_COMPRESS:
+		ret = crypto_comp_compress(tfm, src, slen, dst, dlen);
+		break;
+	default:
+		ret = crypto_comp_decompress(tfm, src, slen, dst, dlen);
+		break;
+	}
+	put_cpu();
+	ns = local_clock() - start;
+
+	spin_lock(&zram->stat64_lock);
+	if (op == ZRAM_COMPOP_COMPRESS) {
+		zram->stats.num_compress++;
+		zram->stats.compress_ns += ns;
+	} else {
+		zram->stats.num_decompress++;
+		zram->stats.decompress_ns += ns;
+	}
+	spin_unlock(&zram->stat64_lock);
+
+	return ret;
+}
+
+static void zram_comp_free(struct zram *zram)
+{
+	int cpu;
+
+	if (!zram->comp_tfms)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		struct crypto_comp *tfm = *per_cpu_ptr(zram->comp_tfms, cpu);
+
+		if (tfm)
+			crypto_free_comp(tfm);
+	}
+	free_percpu(zram->comp_tfms);
+	zram->comp_tfms = NULL;
 }
 
-static int page_zero_filled(void *ptr)
+static int zram_comp_init(struct zram *zram)
+{
+	struct crypto_comp *tfm;
+	int cpu;
+
+	zram->comp_tfms = alloc_percpu(struct crypto_comp *);
+	if (!zram->comp_tfms)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		tfm = crypto_alloc_comp(zram->compressor, 0, 0);
+		if (IS_ERR(tfm)) {
+			zram_comp_free(zram);
+			return PTR_ERR(tfm);
+		}
+		*per_cpu_ptr(zram->comp_tfms, cpu) = tfm;
+	}
+
+	return 0;
+}
+
+static void zram_stream_free(struct zram_stream *zstrm)
+{
+	free_pages((unsigned long)zstrm->buffer, 1);
+	kfree(zstrm);
+}
+
+static struct zram_stream *zram_stream_alloc(void)
+{
+	struct zram_stream *zstrm;
+
+	zstrm = kzalloc(sizeof(*zstrm), GFP_KERNEL);
+	if (!zstrm)
+		return NULL;
+
+	zstrm->buffer = (void *)__get_free_pages(GFP_KERNEL | __GFP_ZERO, 1);
+	if (!zstrm->buffer) {
+		kfree(zstrm);
+		return NULL;
+	}
+
+	return zstrm;
+}
+
+static struct zram_stream *zram_stream_get(struct zram *zram)
+{
+	struct zram_stream *zstrm;
+
+	spin_lock(&zram->stream_lock);
+	while (list_empty(&zram->idle_streams)) {
+		spin_unlock(&zram->stream_lock);
+		wait_event(zram->stream_wait,
+			   !list_empty(&zram->idle_streams));
+		spin_lock(&zram->stream_lock);
+	}
+	zstrm = list_first_entry(&zram->idle_streams, struct zram_stream,
+				 list);
+	list_del(&zstrm->list);
+	spin_unlock(&zram->stream_lock);
+
+	return zstrm;
+}
+
+static void zram_stream_put(struct zram *zram, struct zram_stream *zstrm)
+{
+	spin_lock(&zram->stream_lock);
+	list_add(&zstrm->list, &zram->idle_streams);
+	spin_unlock(&zram->stream_lock);
+
+	wake_up(&zram->stream_wait);
+}
+
+static int page_same_filled(void *ptr, unsigned long *element)
 {
 	unsigned int pos;
 	unsigned long *page;
 
 	page = (unsigned long *)ptr;
 
-	for (pos = 0; pos != PAGE_SIZE / sizeof(*page); pos++) {
-		if (page[pos])
+	for (pos = 1; pos != PAGE_SIZE / sizeof(*page); pos++) {
+		if (page[pos] != page[0])
 			return 0;
 	}
 
+	*element = page[0];
 	return 1;
 }
 
+static void zram_fill_page(unsigned char *ptr, unsigned long element)
+{
+	unsigned int pos;
+	unsigned long *page;
+
+	if (!element) {
+		memset(ptr, 0, PAGE_SIZE);
+		return;
+	}
+
+	page = (unsigned long *)ptr;
+
+	for (pos = 0; pos != PAGE_SIZE / sizeof(*page); pos++)
+		page[pos] = element;
+}
+
+static struct zram_hash *zram_hash(struct zram *zram, u32 checksum)
+{
+	return &zram->hash[checksum & (zram->hash_size - 1)];
+}
+
+/*
+ * zram_dedup_get - looks for an object holding the same 'len' bytes as
+ * 'mem', whose checksum is 'checksum', and takes a reference on it.
+ * Returns NULL if there is none.
+ */
+static struct zram_entry *zram_dedup_get(struct zram *zram,
+		unsigned char *mem, unsigned int len, u32 checksum)
+{
+	struct zram_hash *hash = zram_hash(zram, checksum);
+	struct zram_entry *entry, *found = NULL;
+	struct hlist_node *pos;
+	unsigned char *cmem;
+	int match;
+
+	spin_lock(&hash->lock);
+	hlist_for_each_entry(entry, pos, &hash->head, node) {
+		if (entry->checksum != checksum || entry->len != len)
+			continue;
+
+		cmem = zs_map_object(zram->mem_pool, entry->handle);
+		match = !memcmp(cmem + sizeof(struct zobj_header), mem, len);
+		zs_unmap_object(zram->mem_pool, entry->handle);
+		if (match) {
+			entry->refcount++;
+			found = entry;
+			break;
+		}
+	}
+	spin_unlock(&hash->lock);
+
+	zram_stat64_inc(zram, &zram->stats.dedup_lookups);
+	if (found) {
+		zram_stat64_inc(zram, &zram->stats.dedup_hits);
+		atomic_inc(&zram->stats.pages_dedup);
+	}
+
+	return found;
+}
+
+/* Makes the new object 'handle' available to zram_dedup_get() */
+static struct zram_entry *zram_dedup_add(struct zram *zram, void *handle,
+		unsigned int len, u32 checksum)
+{
+	struct zram_hash *hash = zram_hash(zram, checksum);
+	struct zram_entry *entry;
+
+	entry = kmalloc(sizeof(*entry), GFP_NOIO);
+	if (!entry)
+		return NULL;
+
+	entry->handle = handle;
+	entry->checksum = checksum;
+	entry->len = len;
+	entry->refcount = 1;
+
+	spin_lock(&hash->lock);
+	hlist_add_head(&entry->node, &hash->head);
+	spin_unlock(&hash->lock);
+
+	return entry;
+}
+
+/* Drops a page's reference, freeing the object with the last one */
+static void zram_dedup_put(struct zram *zram, struct zram_entry *entry)
+{
+	struct zram_hash *hash = zram_hash(zram, entry->checksum);
+	int refcount;
+
+	spin_lock(&hash->lock);
+	refcount = --entry->refcount;
+	if (!refcount)
+		hlist_del(&entry->node);
+	spin_unlock(&hash->lock);
+
+	if (refcount) {
+		atomic_dec(&zram->stats.pages_dedup);
+		return;
+	}
+
+	zs_free(zram->mem_pool, entry->handle);
+	kfree(entry);
+}
+
+static int zram_dedup_init(struct zram *zram)
+{
+	size_t i;
+
+	zram->hash_size = roundup_pow_of_two(
+			max_t(size_t, (zram->disksize >> PAGE_SHIFT) / 16, 1));
+	zram->hash = vzalloc(zram->hash_size * sizeof(*zram->hash));
+	if (!zram->hash)
+		return -ENOMEM;
+
+	for (i = 0; i < zram->hash_size; i++) {
+		spin_lock_init(&zram->hash[i].lock);
+		INIT_HLIST_HEAD(&zram->hash[i].head);
+	}
+
+	return 0;
+}
+
+/* The zsmalloc object of a compressed page */
+static void *zram_get_handle(struct zram *zram, u32 index)
+{
+	if (zram->dedup)
+		return zram->table[index].entry->handle;
+
+	return zram->table[index].handle;
+}
+
+static void zram_free_handle(struct zram *zram, u32 index)
+{
+	if (zram->dedup)
+		zram_dedup_put(zram, zram->table[index].entry);
+	else
+		zs_free(zram->mem_pool, zram->table[index].handle);
+}
+
 static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 {
 	if (!zram->disksize) {
@@ -133,69 +426,186 @@ static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 	zram->disksize &= PAGE_MASK;
 }
 
-static void zram_free_page(struct zram *zram, size_t index)
+/* Completion of a page read from or written to the backing device */
+struct zram_wb_req {
+	struct page *page;
+	u32 index;
+	unsigned long block;
+	int error;
+	struct completion done;
+};
+
+static unsigned long zram_wb_alloc_block(struct zram *zram)
 {
-	void *handle = zram->table[index].handle;
+	unsigned long block;
 
-	if (unlikely(!handle)) {
-		/*
-		 * No memory is allocated for zero filled pages.
-		 * Simply clear zero page flag.
-		 */
-		if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-			zram_clear_flag(zram, index, ZRAM_ZERO);
-			zram_stat_dec(&zram->stats.pages_zero);
-		}
+	do {
+		block = find_next_zero_bit(zram->bd_bitmap,
+					   zram->bd_nr_pages, 1);
+		if (block >= zram->bd_nr_pages)
+			return 0;
+	} while (test_and_set_bit(block, zram->bd_bitmap));
+
+	return block;
+}
+
+static void zram_wb_free_block(struct zram *zram, unsigned long block)
+{
+	clear_bit(block, zram->bd_bitmap);
+}
+
+static void zram_bdev_end_io(struct bio *bio, int err)
+{
+	struct zram_wb_req *req = bio->bi_private;
+
+	if (!err && !test_bit(BIO_UPTODATE, &bio->bi_flags))
+		err = -EIO;
+	req->error = err;
+	complete(&req->done);
+	bio_put(bio);
+}
+
+/* Starts the transfer of 'req', which completes req->done in any case */
+static void zram_bdev_submit(struct zram *zram, struct zram_wb_req *req,
+			     int rw)
+{
+	struct bio *bio;
+
+	init_completion(&req->done);
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	if (!bio) {
+		req->error = -ENOMEM;
+		complete(&req->done);
 		return;
 	}
 
-	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
-		__free_page(handle);
-		zram_clear_flag(zram, index, ZRAM_UNCOMPRESSED);
-		zram_stat_dec(&zram->stats.pages_expand);
-		goto out;
+	bio->bi_sector = (sector_t)req->block << SECTORS_PER_PAGE_SHIFT;
+	bio->bi_bdev = zram->bdev;
+	bio->bi_end_io = zram_bdev_end_io;
+	bio->bi_private = req;
+	if (!bio_add_page(bio, req->page, PAGE_SIZE, 0)) {
+		bio_put(bio);
+		req->error = -EIO;
+		complete(&req->done);
+		return;
+	}
+
+	submit_bio(rw, bio);
+}
+
+static int __zram_bdev_read(struct zram *zram, unsigned char *mem,
+			    unsigned long block)
+{
+	struct zram_wb_req req;
+
+	req.page = alloc_page(GFP_NOIO);
+	if (!req.page)
+		return -ENOMEM;
+	req.block = block;
+
+	zram_bdev_submit(zram, &req, READ);
+	wait_for_completion(&req.done);
+	if (!req.error) {
+		memcpy(mem, page_address(req.page), PAGE_SIZE);
+		zram_stat64_inc(zram, &zram->stats.bd_reads);
 	}
+	__free_page(req.page);
 
-	zs_free(zram->mem_pool, handle);
+	return req.error;
+}
 
-	if (zram->table[index].size <= PAGE_SIZE / 2)
-		zram_stat_dec(&zram->stats.good_compress);
+struct zram_bdev_read_work {
+	struct work_struct work;
+	struct zram *zram;
+	unsigned char *mem;
+	unsigned long block;
+	int error;
+};
 
-out:
-	zram_stat64_sub(zram, &zram->stats.compr_size,
-			zram->table[index].size);
-	zram_stat_dec(&zram->stats.pages_stored);
+static void zram_bdev_read_fn(struct work_struct *work)
+{
+	struct zram_bdev_read_work *rw =
+		container_of(work, struct zram_bdev_read_work, work);
 
-	zram->table[index].handle = NULL;
-	zram->table[index].size = 0;
+	rw->error = __zram_bdev_read(rw->zram, rw->mem, rw->block);
 }
 
-static void handle_zero_page(struct bio_vec *bvec)
+/*
+ * Within zram_make_request(), submit_bio() only adds the bio to
+ * current->bio_list, to be issued once we return, so the read is made and
+ * waited for from zram_bd_wq instead. 'mem' must not be an atomic kmap.
+ */
+static int zram_bdev_read(struct zram *zram, unsigned char *mem,
+			  unsigned long block)
 {
-	struct page *page = bvec->bv_page;
-	void *user_mem;
+	struct zram_bdev_read_work rw;
 
-	user_mem = kmap_atomic(page);
-	memset(user_mem + bvec->bv_offset, 0, bvec->bv_len);
-	kunmap_atomic(user_mem);
+	if (!current->bio_list)
+		return __zram_bdev_read(zram, mem, block);
 
-	flush_dcache_page(page);
+	INIT_WORK_ONSTACK(&rw.work, zram_bdev_read_fn);
+	rw.zram = zram;
+	rw.mem = mem;
+	rw.block = block;
+	queue_work(zram_bd_wq, &rw.work);
+	flush_work(&rw.work);
+	destroy_work_on_stack(&rw.work);
+
+	return rw.error;
 }
 
-static void handle_uncompressed_page(struct zram *zram, struct bio_vec *bvec,
-				     u32 index, int offset)
+/* Called with the table entry locked */
+static void zram_free_page(struct zram *zram, size_t index)
 {
-	struct page *page = bvec->bv_page;
-	unsigned char *user_mem, *cmem;
+	void *handle = zram->table[index].handle;
+	size_t size = zram_get_obj_size(zram, index);
 
-	user_mem = kmap_atomic(page);
-	cmem = kmap_atomic(zram->table[index].handle);
+	zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+	zram_clear_flag(zram, index, ZRAM_IDLE);
 
-	memcpy(user_mem + bvec->bv_offset, cmem + offset, bvec->bv_len);
-	kunmap_atomic(cmem);
-	kunmap_atomic(user_mem);
+	if (zram_test_flag(zram, index, ZRAM_WB)) {
+		zram_wb_free_block(zram, zram->table[index].element);
+		zram_clear_flag(zram, index, ZRAM_WB);
+		atomic_dec(&zram->stats.pages_wb);
+		zram->table[index].element = 0;
+		return;
+	}
 
-	flush_dcache_page(page);
+	/*
+	 * No memory is allocated for same filled pages.
+	 * Simply clear same page flag.
+	 */
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		zram_clear_flag(zram, index, ZRAM_SAME);
+		if (!zram->table[index].element)
+			atomic_dec(&zram->stats.pages_zero);
+		atomic_dec(&zram->stats.pages_same);
+		zram->table[index].element = 0;
+		return;
+	}
+
+	if (unlikely(!handle))
+		return;
+
+	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
+		__free_page(handle);
+		zram_clear_flag(zram, index, ZRAM_UNCOMPRESSED);
+		atomic_dec(&zram->stats.pages_expand);
+		goto out;
+	}
+
+	zram_free_handle(zram, index);
+
+	if (size <= PAGE_SIZE / 2)
+		atomic_dec(&zram->stats.good_compress);
+
+out:
+	zram_stat64_sub(zram, &zram->stats.compr_size, size);
+	atomic_dec(&zram->stats.pages_stored);
+
+	zram->table[index].handle = NULL;
+	zram_set_obj_size(zram, index, 0);
 }
 
 static inline int is_partial_io(struct bio_vec *bvec)
@@ -203,35 +613,84 @@ static inline int is_partial_io(struct bio_vec *bvec)
 	return bvec->bv_len != PAGE_SIZE;
 }
 
-static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
-			  u32 index, int offset, struct bio *bio)
+/*
+ * Reads back the whole page stored at 'index' into 'mem'. Sleeps for pages
+ * on the backing device.
+ */
+static int zram_decompress_page(struct zram *zram, unsigned char *mem,
+				u32 index)
 {
-	int ret;
-	size_t clen;
-	struct page *page;
+	int ret = 0;
+	unsigned int clen = PAGE_SIZE;
 	struct zobj_header *zheader;
-	unsigned char *user_mem, *cmem, *uncmem = NULL;
+	unsigned char *cmem;
+	void *handle;
 
-	page = bvec->bv_page;
+	zram_lock_table(zram, index);
+	handle = zram->table[index].handle;
+
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		unsigned long element = zram->table[index].element;
 
-	if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-		handle_zero_page(bvec);
+		zram_unlock_table(zram, index);
+		zram_fill_page(mem, element);
 		return 0;
 	}
 
-	/* Requested page is not present in compressed area */
-	if (unlikely(!zram->table[index].handle)) {
-		pr_debug("Read before write: sector=%lu, size=%u",
-			 (ulong)(bio->bi_sector), bio->bi_size);
-		handle_zero_page(bvec);
+	if (zram_test_flag(zram, index, ZRAM_WB)) {
+		unsigned long block = zram->table[index].element;
+
+		zram_unlock_table(zram, index);
+		ret = zram_bdev_read(zram, mem, block);
+		if (unlikely(ret)) {
+			pr_err("Backing device read failed! err=%d, "
+			       "page=%u\n", ret, index);
+			zram_stat64_inc(zram, &zram->stats.failed_reads);
+		}
+		return ret;
+	}
+	zram_clear_flag(zram, index, ZRAM_IDLE);
+
+	/* Not present in compressed area */
+	if (!handle) {
+		zram_unlock_table(zram, index);
+		memset(mem, 0, PAGE_SIZE);
 		return 0;
 	}
 
 	/* Page is stored uncompressed since it's incompressible */
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
-		handle_uncompressed_page(zram, bvec, index, offset);
-		return 0;
+		cmem = kmap_atomic(handle);
+		memcpy(mem, cmem, PAGE_SIZE);
+		kunmap_atomic(cmem);
+	} else {
+		handle = zram_get_handle(zram, index);
+		cmem = zs_map_object(zram->mem_pool, handle);
+		ret = zram_comp_op(zram, ZRAM_COMPOP_DECOMPRESS,
+				   cmem + sizeof(*zheader),
+				   zram_get_obj_size(zram, index), mem, &clen);
+		zs_unmap_object(zram->mem_pool, handle);
 	}
+	zram_unlock_table(zram, index);
+
+	/* Should NEVER happen. Return bio error if it does. */
+	if (unlikely(ret)) {
+		pr_err("Decompression failed! err=%d, page=%u\n", ret, index);
+		zram_stat64_inc(zram, &zram->stats.failed_reads);
+		return ret;
+	}
+
+	return 0;
+}
+
+static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
+			  u32 index, int offset, struct bio *bio)
+{
+	int ret;
+	struct page *page;
+	unsigned char *user_mem, *uncmem = NULL;
+
+	page = bvec->bv_page;
 
 	if (is_partial_io(bvec)) {
 		/* Use  a temporary buffer to decompress the page */
@@ -242,88 +701,49 @@ static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 		}
 	}
 
-	user_mem = kmap_atomic(page);
+	user_mem = kmap(page);
 	if (!is_partial_io(bvec))
 		uncmem = user_mem;
-	clen = PAGE_SIZE;
 
-	cmem = zs_map_object(zram->mem_pool, zram->table[index].handle);
-
-	ret = lzo1x_decompress_safe(cmem + sizeof(*zheader),
-				    zram->table[index].size,
-				    uncmem, &clen);
+	ret = zram_decompress_page(zram, uncmem, index);
 
 	if (is_partial_io(bvec)) {
-		memcpy(user_mem + bvec->bv_offset, uncmem + offset,
-		       bvec->bv_len);
+		if (!ret)
+			memcpy(user_mem + bvec->bv_offset, uncmem + offset,
+			       bvec->bv_len);
 		kfree(uncmem);
 	}
+	kunmap(page);
 
-	zs_unmap_object(zram->mem_pool, zram->table[index].handle);
-	kunmap_atomic(user_mem);
-
-	/* Should NEVER happen. Return bio error if it does. */
-	if (unlikely(ret != LZO_E_OK)) {
-		pr_err("Decompression failed! err=%d, page=%u\n", ret, index);
-		zram_stat64_inc(zram, &zram->stats.failed_reads);
+	if (ret)
 		return ret;
-	}
 
 	flush_dcache_page(page);
 
 	return 0;
 }
 
-static int zram_read_before_write(struct zram *zram, char *mem, u32 index)
-{
-	int ret;
-	size_t clen = PAGE_SIZE;
-	struct zobj_header *zheader;
-	unsigned char *cmem;
-
-	if (zram_test_flag(zram, index, ZRAM_ZERO) ||
-	    !zram->table[index].handle) {
-		memset(mem, 0, PAGE_SIZE);
-		return 0;
-	}
-
-	cmem = zs_map_object(zram->mem_pool, zram->table[index].handle);
-
-	/* Page is stored uncompressed since it's incompressible */
-	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
-		memcpy(mem, cmem, PAGE_SIZE);
-		kunmap_atomic(cmem);
-		return 0;
-	}
-
-	ret = lzo1x_decompress_safe(cmem + sizeof(*zheader),
-				    zram->table[index].size,
-				    mem, &clen);
-	zs_unmap_object(zram->mem_pool, zram->table[index].handle);
-
-	/* Should NEVER happen. Return bio error if it does. */
-	if (unlikely(ret != LZO_E_OK)) {
-		pr_err("Decompression failed! err=%d, page=%u\n", ret, index);
-		zram_stat64_inc(zram, &zram->stats.failed_reads);
-		return ret;
-	}
-
-	return 0;
-}
-
+/*
+ * Compression runs on a stream of its own, outside of any lock, so that
+ * writers of different pages proceed in parallel. Only replacing the table
+ * entry happens with it locked.
+ */
 static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			   int offset)
 {
 	int ret;
-	u32 store_offset;
-	size_t clen;
+	unsigned int clen = 2 * PAGE_SIZE;
 	void *handle;
+	u32 checksum = 0;
+	unsigned long element;
+	bool incompressible = false;
+	struct zram_entry *entry;
 	struct zobj_header *zheader;
 	struct page *page, *page_store;
+	struct zram_stream *zstrm = NULL;
 	unsigned char *user_mem, *cmem, *src, *uncmem = NULL;
 
 	page = bvec->bv_page;
-	src = zram->compress_buffer;
 
 	if (is_partial_io(bvec)) {
 		/*
@@ -336,21 +756,12 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			ret = -ENOMEM;
 			goto out;
 		}
-		ret = zram_read_before_write(zram, uncmem, index);
-		if (ret) {
-			kfree(uncmem);
+		ret = zram_decompress_page(zram, uncmem, index);
+		if (ret)
 			goto out;
-		}
 	}
 
-	/*
-	 * System overwrites unused sectors. Free memory associated
-	 * with this sector now.
-	 */
-	if (zram->table[index].handle ||
-	    zram_test_flag(zram, index, ZRAM_ZERO))
-		zram_free_page(zram, index);
-
+	zstrm = zram_stream_get(zram);
 	user_mem = kmap_atomic(page);
 
 	if (is_partial_io(bvec))
@@ -359,24 +770,30 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 	else
 		uncmem = user_mem;
 
-	if (page_zero_filled(uncmem)) {
+	if (page_same_filled(uncmem, &element)) {
 		kunmap_atomic(user_mem);
-		if (is_partial_io(bvec))
-			kfree(uncmem);
-		zram_stat_inc(&zram->stats.pages_zero);
-		zram_set_flag(zram, index, ZRAM_ZERO);
+		/*
+		 * System overwrites unused sectors. Free memory associated
+		 * with this sector now.
+		 */
+		zram_lock_table(zram, index);
+		zram_free_page(zram, index);
+		zram_set_flag(zram, index, ZRAM_SAME);
+		zram->table[index].element = element;
+		zram_unlock_table(zram, index);
+		atomic_inc(&zram->stats.pages_same);
+		if (!element)
+			atomic_inc(&zram->stats.pages_zero);
 		ret = 0;
 		goto out;
 	}
 
-	ret = lzo1x_1_compress(uncmem, PAGE_SIZE, src, &clen,
-			       zram->compress_workmem);
+	ret = zram_comp_op(zram, ZRAM_COMPOP_COMPRESS, uncmem, PAGE_SIZE,
+			   zstrm->buffer, &clen);
 
 	kunmap_atomic(user_mem);
-	if (is_partial_io(bvec))
-			kfree(uncmem);
 
-	if (unlikely(ret != LZO_E_OK)) {
+	if (unlikely(ret)) {
 		pr_err("Compression failed! err=%d\n", ret);
 		goto out;
 	}
@@ -396,78 +813,351 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			goto out;
 		}
 
-		store_offset = 0;
-		zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
-		zram_stat_inc(&zram->stats.pages_expand);
+		incompressible = true;
 		handle = page_store;
-		src = kmap_atomic(page);
 		cmem = kmap_atomic(page_store);
-		goto memstore;
+		if (is_partial_io(bvec)) {
+			memcpy(cmem, uncmem, PAGE_SIZE);
+		} else {
+			src = kmap_atomic(page);
+			memcpy(cmem, src, PAGE_SIZE);
+			kunmap_atomic(src);
+		}
+		kunmap_atomic(cmem);
+		goto update;
+	}
+
+	if (zram->dedup) {
+		checksum = jhash(zstrm->buffer, clen, 0);
+		handle = zram_dedup_get(zram, zstrm->buffer, clen, checksum);
+		if (handle)
+			goto update;
 	}
 
 	handle = zs_malloc(zram->mem_pool, clen + sizeof(*zheader));
 	if (!handle) {
 		pr_info("Error allocating memory for compressed "
-			"page: %u, size=%zu\n", index, clen);
+			"page: %u, size=%u\n", index, clen);
 		ret = -ENOMEM;
 		goto out;
 	}
 	cmem = zs_map_object(zram->mem_pool, handle);
 
-memstore:
 #if 0
 	/* Back-reference needed for memory defragmentation */
-	if (!zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
-		zheader = (struct zobj_header *)cmem;
-		zheader->table_idx = index;
-		cmem += sizeof(*zheader);
-	}
+	zheader = (struct zobj_header *)cmem;
+	zheader->table_idx = index;
+	cmem += sizeof(*zheader);
 #endif
 
-	memcpy(cmem, src, clen);
+	memcpy(cmem, zstrm->buffer, clen);
+	zs_unmap_object(zram->mem_pool, handle);
 
-	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
-		kunmap_atomic(cmem);
-		kunmap_atomic(src);
-	} else {
-		zs_unmap_object(zram->mem_pool, handle);
+	if (zram->dedup) {
+		entry = zram_dedup_add(zram, handle, clen, checksum);
+		if (!entry) {
+			zs_free(zram->mem_pool, handle);
+			ret = -ENOMEM;
+			goto out;
+		}
+		handle = entry;
 	}
 
+update:
+	zram_stream_put(zram, zstrm);
+	zstrm = NULL;
+
+	/*
+	 * System overwrites unused sectors. Free memory associated
+	 * with this sector now.
+	 */
+	zram_lock_table(zram, index);
+	zram_free_page(zram, index);
 	zram->table[index].handle = handle;
-	zram->table[index].size = clen;
+	zram_set_obj_size(zram, index, clen);
+	if (incompressible)
+		zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
+	zram_unlock_table(zram, index);
 
 	/* Update stats */
 	zram_stat64_add(zram, &zram->stats.compr_size, clen);
-	zram_stat_inc(&zram->stats.pages_stored);
-	if (clen <= PAGE_SIZE / 2)
-		zram_stat_inc(&zram->stats.good_compress);
-
-	return 0;
+	atomic_inc(&zram->stats.pages_stored);
+	if (incompressible)
+		atomic_inc(&zram->stats.pages_expand);
+	else if (clen <= PAGE_SIZE / 2)
+		atomic_inc(&zram->stats.good_compress);
+
+	/* better on the backing device than in RAM */
+	if (incompressible && zram->bdev) {
+		set_bit(index, zram->wb_pending);
+		schedule_work(&zram->wb_work);
+	}
 
 out:
+	if (zstrm)
+		zram_stream_put(zram, zstrm);
+	if (is_partial_io(bvec))
+		kfree(uncmem);
 	if (ret)
 		zram_stat64_inc(zram, &zram->stats.failed_writes);
 	return ret;
 }
 
-static int zram_bvec_rw(struct zram *zram, struct bio_vec *bvec, u32 index,
-			int offset, struct bio *bio, int rw)
+/*
+ * Flags page 'index' ZRAM_UNDER_WB if it is to be written back: when it is
+ * stored uncompressed or, on an idle pass, when it has stayed ZRAM_IDLE
+ * since the previous one. Other pages in RAM are flagged ZRAM_IDLE then.
+ */
+static bool zram_wb_mark(struct zram *zram, u32 index, bool idle)
+{
+	bool wb = false;
+
+	zram_lock_table(zram, index);
+	if (zram->table[index].handle &&
+	    !zram_test_flag(zram, index, ZRAM_SAME) &&
+	    !zram_test_flag(zram, index, ZRAM_WB)) {
+		if (zram_test_flag(zram, index, ZRAM_UNCOMPRESSED) ||
+		    (idle && zram_test_flag(zram, index, ZRAM_IDLE))) {
+			zram_set_flag(zram, index, ZRAM_UNDER_WB);
+			wb = true;
+		} else if (idle) {
+			zram_set_flag(zram, index, ZRAM_IDLE);
+		}
+	}
+	zram_unlock_table(zram, index);
+
+	return wb;
+}
+
+/*
+ * Once its block is written, frees the RAM of a page unless it has been
+ * overwritten or freed meanwhile, which clears ZRAM_UNDER_WB.
+ */
+static void zram_wb_commit(struct zram *zram, struct zram_wb_req *req)
+{
+	zram_lock_table(zram, req->index);
+	if (!req->error &&
+	    zram_test_flag(zram, req->index, ZRAM_UNDER_WB)) {
+		zram_free_page(zram, req->index);
+		zram_set_flag(zram, req->index, ZRAM_WB);
+		zram->table[req->index].element = req->block;
+		zram_unlock_table(zram, req->index);
+		atomic_inc(&zram->stats.pages_wb);
+		return;
+	}
+	zram_clear_flag(zram, req->index, ZRAM_UNDER_WB);
+	zram_unlock_table(zram, req->index);
+
+	zram_wb_free_block(zram, req->block);
+}
+
+static void zram_wb_flush(struct zram *zram, struct zram_wb_req *reqs,
+			  int n)
+{
+	struct blk_plug plug;
+	int i;
+
+	blk_start_plug(&plug);
+	for (i = 0; i < n; i++)
+		zram_bdev_submit(zram, &reqs[i], WRITE);
+	blk_finish_plug(&plug);
+
+	for (i = 0; i < n; i++) {
+		wait_for_completion(&reqs[i].done);
+		if (!reqs[i].error)
+			zram_stat64_inc(zram, &zram->stats.bd_writes);
+		zram_wb_commit(zram, &reqs[i]);
+	}
+}
+
+/*
+ * Returns the first page from 'index' on that a pass is to look at, or
+ * 'num_pages'. An idle pass looks at all of them, others only at those
+ * flagged in wb_pending.
+ */
+static size_t zram_wb_next(struct zram *zram, size_t index,
+			   size_t num_pages, bool idle)
+{
+	if (idle)
+		return index;
+
+	for (;; index++) {
+		index = find_next_bit(zram->wb_pending, num_pages, index);
+		if (index >= num_pages ||
+		    test_and_clear_bit(index, zram->wb_pending))
+			return index;
+	}
+}
+
+/* Writes back the pages zram_wb_mark() picks, ZRAM_WB_BATCH at a time */
+static void zram_writeback(struct zram *zram, bool idle)
+{
+	struct zram_wb_req *reqs;
+	unsigned long block;
+	size_t index, num_pages;
+	int nr_reqs, n = 0;
+
+	/* a reset waits for this work with init_lock held */
+	if (!down_read_trylock(&zram->init_lock))
+		return;
+	if (!zram->init_done || !zram->bdev)
+		goto out;
+
+	reqs = kcalloc(ZRAM_WB_BATCH, sizeof(*reqs), GFP_KERNEL);
+	if (!reqs)
+		goto out;
+	for (nr_reqs = 0; nr_reqs < ZRAM_WB_BATCH; nr_reqs++) {
+		reqs[nr_reqs].page = alloc_page(GFP_KERNEL);
+		if (!reqs[nr_reqs].page)
+			break;
+	}
+	if (!nr_reqs)
+		goto out_free;
+
+	mutex_lock(&zram->wb_lock);
+	num_pages = zram->disksize >> PAGE_SHIFT;
+	for (index = zram_wb_next(zram, 0, num_pages, idle);
+	     index < num_pages;
+	     index = zram_wb_next(zram, index + 1, num_pages, idle)) {
+		if (!zram_wb_mark(zram, index, idle))
+			continue;
+
+		block = zram_wb_alloc_block(zram);
+		if (!block) {
+			/* the backing device is full, try again next time */
+			zram_lock_table(zram, index);
+			zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+			zram_unlock_table(zram, index);
+			if (!idle)
+				set_bit(index, zram->wb_pending);
+			break;
+		}
+
+		reqs[n].index = index;
+		reqs[n].block = block;
+		if (zram_decompress_page(zram,
+				page_address(reqs[n].page), index)) {
+			reqs[n].error = -EIO;
+			zram_wb_commit(zram, &reqs[n]);
+			continue;
+		}
+
+		if (++n == nr_reqs) {
+			zram_wb_flush(zram, reqs, n);
+			n = 0;
+		}
+	}
+	if (n)
+		zram_wb_flush(zram, reqs, n);
+	mutex_unlock(&zram->wb_lock);
+
+out_free:
+	while (nr_reqs)
+		__free_page(reqs[--nr_reqs].page);
+	kfree(reqs);
+out:
+	up_read(&zram->init_lock);
+}
+
+static void zram_wb_work(struct work_struct *work)
+{
+	struct zram *zram = container_of(work, struct zram, wb_work);
+
+	zram_writeback(zram, false);
+}
+
+static void zram_idle_work(struct work_struct *work)
+{
+	struct zram *zram = container_of(work, struct zram, idle_work.work);
+	unsigned int secs = ACCESS_ONCE(zram->idle_secs);
+
+	if (!secs)
+		return;
+
+	zram_writeback(zram, true);
+	schedule_delayed_work(&zram->idle_work, secs * HZ);
+}
+
+static void zram_bdev_release(struct zram *zram)
 {
+	if (!zram->bdev)
+		return;
+
+	blkdev_put(zram->bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+	filp_close(zram->backing_file, NULL);
+	vfree(zram->bd_bitmap);
+
+	zram->bdev = NULL;
+	zram->backing_file = NULL;
+	zram->bd_bitmap = NULL;
+	zram->bd_nr_pages = 0;
+}
+
+/*
+ * Sets the block device at 'path' as the backing device of an uninitialized
+ * 'zram', or none if 'path' is "none". Called with init_lock held for
+ * writing.
+ */
+int zram_set_backing_dev(struct zram *zram, const char *path)
+{
+	struct file *file;
+	struct inode *inode;
+	struct block_device *bdev;
+	unsigned long nr_pages;
+	unsigned long *bitmap;
 	int ret;
 
-	if (rw == READ) {
-		down_read(&zram->lock);
-		ret = zram_bvec_read(zram, bvec, index, offset, bio);
-		up_read(&zram->lock);
-	} else {
-		down_write(&zram->lock);
-		ret = zram_bvec_write(zram, bvec, index, offset);
-		up_write(&zram->lock);
+	zram_bdev_release(zram);
+	if (!strcmp(path, "none"))
+		return 0;
+
+	file = filp_open(path, O_RDWR | O_LARGEFILE, 0);
+	if (IS_ERR(file))
+		return PTR_ERR(file);
+
+	inode = file->f_mapping->host;
+	if (!S_ISBLK(inode->i_mode)) {
+		ret = -ENOTBLK;
+		goto fail_close;
 	}
 
+	bdev = bdgrab(I_BDEV(inode));
+	ret = blkdev_get(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL, zram);
+	if (ret < 0)
+		goto fail_close;
+
+	nr_pages = i_size_read(inode) >> PAGE_SHIFT;
+	bitmap = vzalloc(BITS_TO_LONGS(nr_pages) * sizeof(long));
+	if (nr_pages < 2 || !bitmap) {
+		vfree(bitmap);
+		ret = nr_pages < 2 ? -EINVAL : -ENOMEM;
+		goto fail_put;
+	}
+
+	zram->backing_file = file;
+	zram->bdev = bdev;
+	zram->bd_bitmap = bitmap;
+	zram->bd_nr_pages = nr_pages;
+	pr_info("Using %s as backing device, %lu pages\n", path, nr_pages);
+
+	return 0;
+
+fail_put:
+	blkdev_put(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+fail_close:
+	filp_close(file, NULL);
 	return ret;
 }
 
+static int zram_bvec_rw(struct zram *zram, struct bio_vec *bvec, u32 index,
+			int offset, struct bio *bio, int rw)
+{
+	if (rw == READ)
+		return zram_bvec_read(zram, bvec, index, offset, bio);
+
+	return zram_bvec_write(zram, bvec, index, offset);
+}
+
 static void update_position(u32 *index, int *offset, struct bio_vec *bvec)
 {
 	if (*offset + bvec->bv_len >= PAGE_SIZE)
@@ -580,31 +1270,48 @@ error:
 void __zram_reset_device(struct zram *zram)
 {
 	size_t index;
+	struct zram_stream *zstrm, *next;
 
 	zram->init_done = 0;
 
-	/* Free various per-device buffers */
-	kfree(zram->compress_workmem);
-	free_pages((unsigned long)zram->compress_buffer, 1);
+	/* they give up on init_lock, held by the caller */
+	cancel_work_sync(&zram->wb_work);
+	cancel_delayed_work_sync(&zram->idle_work);
 
-	zram->compress_workmem = NULL;
-	zram->compress_buffer = NULL;
+	/* Free compression streams, all idle with I/O shut out */
+	list_for_each_entry_safe(zstrm, next, &zram->idle_streams, list) {
+		list_del(&zstrm->list);
+		zram_stream_free(zstrm);
+	}
+	zram->nr_streams = 0;
+
+	zram_comp_free(zram);
 
 	/* Free all pages that are still in this zram device */
 	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
 		void *handle = zram->table[index].handle;
-		if (!handle)
+		if (!handle || zram_test_flag(zram, index, ZRAM_SAME) ||
+		    zram_test_flag(zram, index, ZRAM_WB))
 			continue;
 
 		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
 			__free_page(handle);
 		else
-			zs_free(zram->mem_pool, handle);
+			zram_free_handle(zram, index);
 	}
 
 	vfree(zram->table);
 	zram->table = NULL;
 
+	vfree(zram->wb_pending);
+	zram->wb_pending = NULL;
+
+	vfree(zram->hash);
+	zram->hash = NULL;
+	zram->hash_size = 0;
+
+	zram_bdev_release(zram);
+
 	zs_destroy_pool(zram->mem_pool);
 	zram->mem_pool = NULL;
 
@@ -625,6 +1332,8 @@ int zram_init_device(struct zram *zram)
 {
 	int ret;
 	size_t num_pages;
+	struct zram_stream *zstrm;
+	int i;
 
 	down_write(&zram->init_lock);
 
@@ -635,17 +1344,21 @@ int zram_init_device(struct zram *zram)
 
 	zram_set_disksize(zram, totalram_pages << PAGE_SHIFT);
 
-	zram->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
-	if (!zram->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
+	ret = zram_comp_init(zram);
+	if (ret) {
+		pr_err("Error allocating %s compressor!\n", zram->compressor);
 		goto fail_no_table;
 	}
 
-	zram->compress_buffer =
-		(void *)__get_free_pages(GFP_KERNEL | __GFP_ZERO, 1);
-	if (!zram->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
+	for (i = 0; i < num_online_cpus(); i++) {
+		zstrm = zram_stream_alloc();
+		if (!zstrm)
+			break;
+		list_add(&zstrm->list, &zram->idle_streams);
+		zram->nr_streams++;
+	}
+	if (!zram->nr_streams) {
+		pr_err("Error allocating compression stream!\n");
 		ret = -ENOMEM;
 		goto fail_no_table;
 	}
@@ -658,6 +1371,13 @@ int zram_init_device(struct zram *zram)
 		goto fail_no_table;
 	}
 
+	zram->wb_pending = vzalloc(BITS_TO_LONGS(num_pages) * sizeof(long));
+	if (!zram->wb_pending) {
+		pr_err("Error allocating writeback bitmap\n");
+		ret = -ENOMEM;
+		goto fail;
+	}
+
 	set_capacity(zram->disk, zram->disksize >> SECTOR_SHIFT);
 
 	/* zram devices sort of resembles non-rotational disks */
@@ -670,7 +1390,15 @@ int zram_init_device(struct zram *zram)
 		goto fail;
 	}
 
+	if (zram->dedup && zram_dedup_init(zram)) {
+		pr_err("Error allocating deduplication hash table\n");
+		ret = -ENOMEM;
+		goto fail;
+	}
+
 	zram->init_done = 1;
+	if (zram->bdev && zram->idle_secs)
+		schedule_delayed_work(&zram->idle_work, zram->idle_secs * HZ);
 	up_write(&zram->init_lock);
 
 	pr_debug("Initialization done!\n");
@@ -692,7 +1420,9 @@ static void zram_slot_free_notify(struct block_device *bdev,
 	struct zram *zram;
 
 	zram = bdev->bd_disk->private_data;
+	zram_lock_table(zram, index);
 	zram_free_page(zram, index);
+	zram_unlock_table(zram, index);
 	zram_stat64_inc(zram, &zram->stats.notify_free);
 }
 
@@ -705,9 +1435,15 @@ static int create_device(struct zram *zram, int device_id)
 {
 	int ret = 0;
 
-	init_rwsem(&zram->lock);
 	init_rwsem(&zram->init_lock);
 	spin_lock_init(&zram->stat64_lock);
+	INIT_LIST_HEAD(&zram->idle_streams);
+	spin_lock_init(&zram->stream_lock);
+	init_waitqueue_head(&zram->stream_wait);
+	strcpy(zram->compressor, default_compressor);
+	mutex_init(&zram->wb_lock);
+	INIT_WORK(&zram->wb_work, zram_wb_work);
+	INIT_DELAYED_WORK(&zram->idle_work, zram_idle_work);
 
 	zram->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!zram->queue) {
@@ -795,11 +1531,17 @@ static int __init zram_init(void)
 		goto out;
 	}
 
+	zram_bd_wq = alloc_workqueue("zram_bd", WQ_UNBOUND | WQ_MEM_RECLAIM, 0);
+	if (!zram_bd_wq) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
 	zram_major = register_blkdev(0, "zram");
 	if (zram_major <= 0) {
 		pr_warning("Unable to get major number\n");
 		ret = -EBUSY;
-		goto out;
+		goto destroy_wq;
 	}
 
 	if (!num_devices) {
@@ -829,6 +1571,8 @@ free_devices:
 	kfree(zram_devices);
 unregister:
 	unregister_blkdev(zram_major, "zram");
+destroy_wq:
+	destroy_workqueue(zram_bd_wq);
 out:
 	return ret;
 }
@@ -847,6 +1591,7 @@ static void __exit zram_exit(void)
 	}
 
 	unregister_blkdev(zram_major, "zram");
+	destroy_workqueue(zram_bd_wq);
 
 	kfree(zram_devices);
 	pr_debug("Cleanup done!\n");
@@ -17,6 +17,10 @@
 
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
+#include <linux/crypto.h>
+#include <linux/list.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
 
 #include "../zsmalloc/zsmalloc.h"
 
@@ -43,6 +47,9 @@ struct zobj_header {
 /* Default zram disk size: 25% of total RAM */
 static const unsigned default_disksize_perc_ram = 25;
 
+/* Default compressor, any crypto_comp algorithm can be set in sysfs */
+static const char default_compressor[] = "lzo";
+
 /*
  * Pages that compress to size greater than this are stored
  * uncompressed in memory.
@@ -55,6 +62,9 @@ static const size_t max_zpage_size = PAGE_SIZE / 4 * 3;
  * otherwise, xv_malloc() would always return failure.
  */
 
+/* Pages written to the backing device at once */
+#define ZRAM_WB_BATCH		32
+
 /*-- End of configurable params */
 
 #define SECTOR_SHIFT		9
@@ -66,26 +76,64 @@ static const size_t max_zpage_size = PAGE_SIZE / 4 * 3;
 #define ZRAM_SECTOR_PER_LOGICAL_BLOCK	\
 	(1 << (ZRAM_LOGICAL_BLOCK_SHIFT - SECTOR_SHIFT))
 
-/* Flags for zram pages (table[page_no].flags) */
+/*
+ * The lower ZRAM_FLAG_SHIFT bits of table[page_no].value hold the object
+ * size (excluding header), the upper bits the zram_pageflags.
+ */
+#define ZRAM_FLAG_SHIFT		(PAGE_SHIFT + 1)
+
+/* Flags for zram pages (table[page_no].value) */
 enum zram_pageflags {
 	/* Page is stored uncompressed */
-	ZRAM_UNCOMPRESSED,
+	ZRAM_UNCOMPRESSED = ZRAM_FLAG_SHIFT,
+
+	/* Page is one word repeated, kept in table[page_no].element */
+	ZRAM_SAME,
 
-	/* Page consists entirely of zeros */
-	ZRAM_ZERO,
+	/* Page is on the backing device, at block table[page_no].element */
+	ZRAM_WB,
+
+	/* Page is being written to the backing device */
+	ZRAM_UNDER_WB,
+
+	/* Page has not been accessed since the last idle writeback pass */
+	ZRAM_IDLE,
+
+	/* Table entry is locked, see zram_lock_table() */
+	ZRAM_ACCESS,
 
 	__NR_ZRAM_PAGEFLAGS,
 };
 
 /*-- Data structures */
 
+/*
+ * A compressed object shared by all the pages with the same content, when
+ * deduplication is on. Hashed by the checksum of that content into
+ * zram->hash, whose bucket lock protects the refcount.
+ */
+struct zram_entry {
+	struct hlist_node node;
+	void *handle;		/* zsmalloc object */
+	u32 checksum;
+	unsigned int len;
+	int refcount;		/* no. of pages stored as this object */
+};
+
+struct zram_hash {
+	spinlock_t lock;
+	struct hlist_head head;
+};
+
 /* Allocated for each disk page */
 struct table {
-	void *handle;
-	u16 size;	/* object size (excluding header) */
-	u8 count;	/* object ref count (not yet used) */
-	u8 flags;
-} __attribute__((aligned(4)));
+	union {
+		void *handle;
+		struct zram_entry *entry;	/* compressed, deduplicated */
+		unsigned long element;		/* ZRAM_SAME, ZRAM_WB */
+	};
+	unsigned long value;
+};
 
 struct zram_stats {
 	u64 compr_size;		/* compressed size of pages stored */
@@ -95,20 +143,65 @@ struct zram_stats {
 	u64 failed_writes;	/* can happen when memory is too low */
 	u64 invalid_io;		/* non-page-aligned I/O requests */
 	u64 notify_free;	/* no. of swap slot free notifications */
-	u32 pages_zero;		/* no. of zero filled pages */
-	u32 pages_stored;	/* no. of pages currently stored */
-	u32 good_compress;	/* % of pages with compression ratio<=50% */
-	u32 pages_expand;	/* % of incompressible pages */
+	u64 num_compress;	/* pages through the compressor */
+	u64 compress_ns;	/* time they took */
+	u64 num_decompress;	/* pages through the decompressor */
+	u64 decompress_ns;	/* time they took */
+	u64 dedup_lookups;	/* compressed pages looked up for a duplicate */
+	u64 dedup_hits;		/* --do-- and found */
+	atomic_t pages_dedup;	/* no. of pages sharing another's object */
+	atomic_t pages_same;	/* no. of same filled pages, zero included */
+	atomic_t pages_zero;	/* no. of zero filled pages */
+	atomic_t pages_wb;	/* no. of pages on the backing device */
+	u64 bd_reads;		/* pages read from the backing device */
+	u64 bd_writes;		/* pages written to the backing device */
+	atomic_t pages_stored;	/* no. of pages currently stored */
+	atomic_t good_compress;	/* % of pages with compression ratio<=50% */
+	atomic_t pages_expand;	/* % of incompressible pages */
+};
+
+/* Compressor output, owned by one writer until it is stored */
+struct zram_stream {
+	void *buffer;
+	struct list_head list;
 };
 
 struct zram {
 	struct zs_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
 	struct table *table;
 	spinlock_t stat64_lock;	/* protect 64-bit stats */
-	struct rw_semaphore lock; /* protect compression buffers and table
-				   * against concurrent read and writes */
+	/* one transform of 'compressor' per cpu, used with preemption off */
+	struct crypto_comp * __percpu *comp_tfms;
+	char compressor[CRYPTO_MAX_ALG_NAME];
+	/* share identical compressed pages, can only change with init_done 0 */
+	bool dedup;
+	struct zram_hash *hash;
+	size_t hash_size;
+	/*
+	 * Backing device, set with init_done 0 and released on reset. One
+	 * bit of bd_bitmap per page of it, set while in use, block 0 is
+	 * never used. Incompressible pages are written to it by wb_work,
+	 * pages left idle for idle_secs by idle_work. wb_pending has a bit
+	 * set for each page stored uncompressed since wb_work last ran, the
+	 * only ones it looks at.
+	 */
+	struct file *backing_file;
+	struct block_device *bdev;
+	unsigned long *bd_bitmap;
+	unsigned long bd_nr_pages;
+	unsigned long *wb_pending;
+	struct mutex wb_lock;	/* one writeback pass at a time */
+	struct work_struct wb_work;
+	struct delayed_work idle_work;
+	unsigned int idle_secs;
+	/*
+	 * Streams not in use by a writer, one per online cpu allocated
+	 * with the device. Writers wait for one when all are in use.
+	 */
+	struct list_head idle_streams;
+	spinlock_t stream_lock;
+	wait_queue_head_t stream_wait;
+	int nr_streams;
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
@@ -131,5 +224,6 @@ extern struct attribute_group zram_disk_attr_group;
 
 extern int zram_init_device(struct zram *zram);
 extern void __zram_reset_device(struct zram *zram);
+extern int zram_set_backing_dev(struct zram *zram, const char *path);
 
 #endif
@@ -100,6 +100,10 @@ int mm_match_cgroup(const struct mm_struct *mm, const struct mem_cgroup *cgroup)
 
 extern struct cgroup_subsys_state *mem_cgroup_css(struct mem_cgroup *memcg);
 
+extern void mem_cgroup_lowmem_stat(struct mem_cgroup *memcg,
+		unsigned long *limit, unsigned long *margin,
+		unsigned long *cache);
+
 extern int
 mem_cgroup_prepare_migration(struct page *page,
 	struct page *newpage, struct mem_cgroup **memcgp, gfp_t gfp_mask);
@@ -40,6 +40,31 @@ enum oom_constraint {
 	CONSTRAINT_MEMCG,
 };
 
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+/* keep the lowmemorykiller's index of processes by oom_score_adj current */
+extern void lowmem_add_task(struct task_struct *p);
+extern void lowmem_del_task(struct task_struct *p);
+extern void lowmem_update_adj(struct task_struct *p);
+/* let the lowmemorykiller act for a memory cgroup at its limit */
+extern void lowmem_memcg_limit(struct mem_cgroup *memcg);
+#else
+static inline void lowmem_add_task(struct task_struct *p)
+{
+}
+
+static inline void lowmem_del_task(struct task_struct *p)
+{
+}
+
+static inline void lowmem_update_adj(struct task_struct *p)
+{
+}
+
+static inline void lowmem_memcg_limit(struct mem_cgroup *memcg)
+{
+}
+#endif
+
 extern void compare_swap_oom_score_adj(int old_val, int new_val);
 extern int test_set_oom_score_adj(int new_val);
 
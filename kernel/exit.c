@@ -93,6 +93,7 @@ static void __exit_signal(struct task_struct *tsk)
 	posix_cpu_timers_exit(tsk);
 	if (group_dead) {
 		posix_cpu_timers_exit_group(tsk);
+		lowmem_del_task(tsk);
 		tty = sig->tty;
 		sig->tty = NULL;
 	} else {
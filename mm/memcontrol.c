@@ -2222,6 +2222,8 @@ static int mem_cgroup_do_charge(struct mem_cgroup *memcg, gfp_t gfp_mask,
 	if (!(gfp_mask & __GFP_WAIT))
 		return CHARGE_WOULDBLOCK;
 
+	lowmem_memcg_limit(mem_over_limit);
+
 	ret = mem_cgroup_reclaim(mem_over_limit, gfp_mask, flags);
 	if (mem_cgroup_margin(mem_over_limit) >= nr_pages)
 		return CHARGE_RETRY;
@@ -3859,6 +3861,24 @@ static unsigned long mem_cgroup_recursive_stat(struct mem_cgroup *memcg,
 	return val;
 }
 
+/*
+ * mem_cgroup_lowmem_stat - returns, in pages, the limit of @memcg, the
+ * amount it can still be charged with and how much of it is page cache.
+ * Used by the Android lowmemorykiller.
+ */
+void mem_cgroup_lowmem_stat(struct mem_cgroup *memcg, unsigned long *limit,
+			    unsigned long *margin, unsigned long *cache)
+{
+	u64 val;
+
+	val = res_counter_read_u64(&memcg->res, RES_LIMIT);
+	if (do_swap_account)
+		val = min(val, res_counter_read_u64(&memcg->memsw, RES_LIMIT));
+	*limit = min_t(u64, val >> PAGE_SHIFT, ULONG_MAX);
+	*margin = mem_cgroup_margin(memcg);
+	*cache = mem_cgroup_recursive_stat(memcg, MEM_CGROUP_STAT_CACHE);
+}
+
 static inline u64 mem_cgroup_usage(struct mem_cgroup *memcg, bool swap)
 {
 	u64 val;
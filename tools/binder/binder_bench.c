@@ -0,0 +1,674 @@
+/*
+ * binder_bench: binder transaction throughput and latency
+ * Copyright (c) 2012 Rong Shen <rong1129@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Runs rounds of 1 to N client/server process pairs. In each round every
+ * client makes two-way transactions to its own server for a fixed time,
+ * and the total rate is reported. With one pair per cpu and nothing shared
+ * between the pairs but the driver, the rate should grow linearly with the
+ * number of pairs; where it doesn't, the driver serializes them.
+ *
+ * The round trip time of every transaction is kept in a log-linear
+ * histogram (buckets within 1/32 of their value) and the round reports its
+ * median and 99th percentile. A single pair (-n 1) is a ping-pong test of
+ * the driver's latency, -a puts both ends of it on the same cpu.
+ *
+ * With -S all clients of a round call one server instead, which runs a
+ * looper thread per client, so that they contend for the locks of one
+ * proc rather than only for the driver's global ones. With -o every
+ * transaction also passes a binder of the client's, which the driver turns
+ * into a node in the client and a ref in the server that go away again
+ * with the buffer.
+ *
+ * Servers publish their binder to the benchmark's own context manager, so
+ * the benchmark must be able to become it: run it as root with no
+ * servicemanager running. It works with either binder driver.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "../../drivers/staging/android/binder.h"
+
+#define BINDER_DEV		"/dev/binder"
+#define BINDER_MAP_SIZE		(1024 * 1024 - 2 * 4096)	/* as libbinder */
+#define MAX_PAIRS		64
+
+#define LAT_SUB_BITS		5
+#define LAT_BUCKETS		((64 - LAT_SUB_BITS + 1) << LAT_SUB_BITS)
+
+enum {
+	CODE_REGISTER = 1,	/* server -> context manager: index, binder */
+	CODE_LOOKUP,		/* client -> context manager: index */
+	CODE_PING,		/* client -> server */
+};
+
+/* State shared by all processes of the benchmark */
+struct bench_shared {
+	volatile int error;
+	volatile int ctx_mgr_ready;
+	volatile int registered;
+	volatile int ready;
+	volatile int start;
+	volatile int stop;
+	unsigned long long count[MAX_PAIRS];
+	unsigned long long lat[MAX_PAIRS][LAT_BUCKETS];	/* ns */
+};
+
+struct bench_binder {
+	int fd;
+	void *map;
+	uint32_t rbuf[1024];
+};
+
+struct bench_obj {
+	struct flat_binder_object obj;
+	uint32_t index;
+};
+
+static struct bench_shared *shared;
+static int nr_pairs = 0;
+static int seconds = 3;
+static int data_size = 128;
+static int pin_cpus;
+static int shared_server;
+static int pass_objs;
+static int nr_cpus;
+
+
+static void die(const char *what)
+{
+	perror(what);
+	shared->error = 1;
+	exit(1);
+}
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Values below 2^LAT_SUB_BITS have a bucket each, above that every power of
+   two is split into 2^LAT_SUB_BITS buckets */
+static int lat_bucket(unsigned long long ns)
+{
+	int shift;
+
+	if (ns < (1 << LAT_SUB_BITS))
+		return ns;
+
+	shift = 63 - __builtin_clzll(ns) - LAT_SUB_BITS;
+	return ((shift + 1) << LAT_SUB_BITS) +
+	       ((ns >> shift) & ((1 << LAT_SUB_BITS) - 1));
+}
+
+/* The smallest value of a bucket */
+static unsigned long long lat_value(int bucket)
+{
+	int shift;
+
+	if (bucket < (1 << LAT_SUB_BITS))
+		return bucket;
+
+	shift = (bucket >> LAT_SUB_BITS) - 1;
+	return (unsigned long long)((bucket & ((1 << LAT_SUB_BITS) - 1)) |
+				    (1 << LAT_SUB_BITS)) << shift;
+}
+
+/* The value below which 'pct' percent of the 'n' pairs' samples fall */
+static double lat_percentile(int n, unsigned long long total, double pct)
+{
+	unsigned long long seen = 0, target = total * pct / 100;
+	int i, b;
+
+	for (b = 0; b < LAT_BUCKETS; b++) {
+		for (i = 0; i < n; i++)
+			seen += shared->lat[i][b];
+		if (seen > target)
+			return lat_value(b) / 1000.0;
+	}
+
+	return 0;
+}
+
+static void pin_cpu(int cpu)
+{
+	cpu_set_t set;
+
+	if (!pin_cpus)
+		return;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu % nr_cpus, &set);
+	if (sched_setaffinity(0, sizeof(set), &set) < 0)
+		die("sched_setaffinity");
+}
+
+static void binder_open(struct bench_binder *b)
+{
+	struct binder_version vers;
+
+	b->fd = open(BINDER_DEV, O_RDWR);
+	if (b->fd < 0)
+		die("open " BINDER_DEV);
+
+	if (ioctl(b->fd, BINDER_VERSION, &vers) < 0)
+		die("BINDER_VERSION");
+	if (vers.protocol_version != BINDER_CURRENT_PROTOCOL_VERSION) {
+		fprintf(stderr, "binder protocol %ld, expected %d\n",
+			vers.protocol_version, BINDER_CURRENT_PROTOCOL_VERSION);
+		die("BINDER_VERSION");
+	}
+
+	b->map = mmap(NULL, BINDER_MAP_SIZE, PROT_READ, MAP_PRIVATE, b->fd, 0);
+	if (b->map == MAP_FAILED)
+		die("mmap");
+}
+
+/* Writes 'wsize' bytes of commands, then reads into b->rbuf if 'read' */
+static int binder_io(struct bench_binder *b, void *wbuf, size_t wsize,
+		     int read)
+{
+	struct binder_write_read bwr;
+
+	bwr.write_buffer = (unsigned long)wbuf;
+	bwr.write_size = wsize;
+	bwr.write_consumed = 0;
+	bwr.read_buffer = (unsigned long)b->rbuf;
+	bwr.read_size = read ? sizeof(b->rbuf) : 0;
+	bwr.read_consumed = 0;
+
+	while (ioctl(b->fd, BINDER_WRITE_READ, &bwr) < 0) {
+		if (errno != EINTR)
+			die("BINDER_WRITE_READ");
+	}
+
+	return bwr.read_consumed;
+}
+
+static void binder_free(struct bench_binder *b, const void *buf)
+{
+	struct {
+		uint32_t cmd;
+		const void *buf;
+	} __attribute__((packed)) free_buf = { BC_FREE_BUFFER, buf };
+
+	binder_io(b, &free_buf, sizeof(free_buf), 0);
+}
+
+/* Commands a read may return that need an answer whatever we wait for */
+static int binder_handle_ref(struct bench_binder *b, uint32_t cmd,
+			     struct binder_ptr_cookie *pc)
+{
+	struct {
+		uint32_t cmd;
+		struct binder_ptr_cookie pc;
+	} __attribute__((packed)) done;
+
+	if (cmd != BR_INCREFS && cmd != BR_ACQUIRE)
+		return 0;
+
+	done.cmd = (cmd == BR_INCREFS) ? BC_INCREFS_DONE : BC_ACQUIRE_DONE;
+	done.pc = *pc;
+	binder_io(b, &done, sizeof(done), 0);
+	return 1;
+}
+
+/*
+ * Sends 'wbuf' and reads until a BR_REPLY, returned in 'reply'. The reply
+ * buffer must be freed with BC_FREE_BUFFER by the caller.
+ */
+static int binder_call(struct bench_binder *b, void *wbuf, size_t wsize,
+		       struct binder_transaction_data *reply)
+{
+	uint32_t *p, *end, cmd;
+
+	for (;;) {
+		end = (uint32_t *)((char *)b->rbuf + binder_io(b, wbuf, wsize, 1));
+		wsize = 0;
+
+		for (p = b->rbuf; p < end; p = (uint32_t *)((char *)p + _IOC_SIZE(cmd))) {
+			cmd = *p++;
+			switch (cmd) {
+			case BR_REPLY:
+				memcpy(reply, p, sizeof(*reply));
+				if (reply->flags & TF_STATUS_CODE)
+					return -1;
+				return 0;
+			case BR_DEAD_REPLY:
+			case BR_FAILED_REPLY:
+				return -1;
+			default:
+				binder_handle_ref(b, cmd, (struct binder_ptr_cookie *)p);
+				break;
+			}
+		}
+	}
+}
+
+struct bench_txn {
+	uint32_t free_cmd;
+	void *free_buf;
+	uint32_t cmd;
+	struct binder_transaction_data tr;
+} __attribute__((packed));
+
+static void txn_init(struct bench_txn *t, uint32_t cmd, uint32_t handle,
+		     uint32_t code, const void *data, size_t size,
+		     const size_t *offsets, size_t offsets_size)
+{
+	memset(t, 0, sizeof(*t));
+	t->free_cmd = BC_FREE_BUFFER;
+	t->cmd = cmd;
+	t->tr.target.handle = handle;
+	t->tr.code = code;
+	t->tr.data_size = size;
+	t->tr.offsets_size = offsets_size;
+	t->tr.data.ptr.buffer = data;
+	t->tr.data.ptr.offsets = offsets;
+}
+
+/* The command to send, preceded by freeing the last reply if there's one */
+static void *txn_buf(struct bench_txn *t, size_t *size)
+{
+	if (t->free_buf) {
+		*size = sizeof(*t);
+		return t;
+	}
+
+	*size = sizeof(*t) - offsetof(struct bench_txn, cmd);
+	return &t->cmd;
+}
+
+static int txn_call(struct bench_binder *b, struct bench_txn *t,
+		    struct binder_transaction_data *reply)
+{
+	size_t size;
+	void *buf = txn_buf(t, &size);
+
+	return binder_call(b, buf, size, reply);
+}
+
+/*
+ * Serves transactions until killed. The context manager keeps the server
+ * handles registered, servers answer pings with an empty reply.
+ *
+ * References are held by keeping the buffers that brought them rather than
+ * with BC_ACQUIRE, whose argument the two drivers read with different sizes
+ * on 64-bit.
+ */
+static void binder_loop(struct bench_binder *b, int ctx_mgr)
+{
+	uint32_t handles[MAX_PAIRS], *p, *end, cmd;
+	const void *reg_bufs[MAX_PAIRS];
+	struct binder_transaction_data *tr;
+	struct bench_txn reply;
+	struct bench_obj lookup;
+	size_t offset = 0, size;
+	uint32_t loop = BC_ENTER_LOOPER;
+	void *buf;
+
+	memset(handles, 0, sizeof(handles));
+	memset(reg_bufs, 0, sizeof(reg_bufs));
+	binder_io(b, &loop, sizeof(loop), 0);
+
+	for (;;) {
+		end = (uint32_t *)((char *)b->rbuf + binder_io(b, NULL, 0, 1));
+
+		for (p = b->rbuf; p < end; p = (uint32_t *)((char *)p + _IOC_SIZE(cmd))) {
+			cmd = *p++;
+			if (binder_handle_ref(b, cmd, (struct binder_ptr_cookie *)p) ||
+			    cmd != BR_TRANSACTION)
+				continue;
+
+			tr = (struct binder_transaction_data *)p;
+			txn_init(&reply, BC_REPLY, 0, 0, NULL, 0, NULL, 0);
+			reply.free_buf = (void *)tr->data.ptr.buffer;
+
+			if (ctx_mgr && tr->code == CODE_REGISTER &&
+			    tr->data_size == sizeof(lookup)) {
+				memcpy(&lookup, tr->data.ptr.buffer, sizeof(lookup));
+				if (lookup.index < MAX_PAIRS &&
+				    lookup.obj.type == BINDER_TYPE_HANDLE) {
+					/* the previous round's server is gone */
+					if (reg_bufs[lookup.index])
+						binder_free(b, reg_bufs[lookup.index]);
+					reg_bufs[lookup.index] = tr->data.ptr.buffer;
+					handles[lookup.index] = lookup.obj.handle;
+					reply.free_buf = NULL;
+				}
+			} else if (ctx_mgr && tr->code == CODE_LOOKUP &&
+				   tr->data_size == sizeof(uint32_t)) {
+				uint32_t index = *(uint32_t *)tr->data.ptr.buffer;
+
+				if (index < MAX_PAIRS && handles[index]) {
+					memset(&lookup, 0, sizeof(lookup));
+					lookup.obj.type = BINDER_TYPE_HANDLE;
+					lookup.obj.handle = handles[index];
+					lookup.index = index;
+					reply.tr.data_size = sizeof(lookup);
+					reply.tr.data.ptr.buffer = &lookup;
+					reply.tr.offsets_size = sizeof(offset);
+					reply.tr.data.ptr.offsets = &offset;
+				}
+			}
+
+			buf = txn_buf(&reply, &size);
+			binder_io(b, buf, size, 0);
+		}
+	}
+}
+
+static pid_t fork_ctx_mgr(void)
+{
+	struct bench_binder b;
+	pid_t pid;
+
+	pid = fork();
+	if (pid)
+		return pid;
+
+	binder_open(&b);
+	if (ioctl(b.fd, BINDER_SET_CONTEXT_MGR, 0) < 0)
+		die("BINDER_SET_CONTEXT_MGR (is servicemanager running?)");
+
+	shared->ctx_mgr_ready = 1;
+	binder_loop(&b, 1);
+	exit(0);
+}
+
+static void *looper_thread(void *arg)
+{
+	binder_loop(arg, 0);
+	return NULL;
+}
+
+/* Another thread serving on 'b', sharing its fd and mapping */
+static void start_looper(struct bench_binder *b)
+{
+	struct bench_binder *tb;
+	pthread_t thread;
+
+	tb = malloc(sizeof(*tb));
+	if (!tb)
+		die("malloc");
+	*tb = *b;
+	errno = pthread_create(&thread, NULL, looper_thread, tb);
+	if (errno)
+		die("pthread_create");
+}
+
+/* Registers as 'index' and serves with 'nr_threads' looper threads */
+static pid_t fork_server(int index, int nr_threads)
+{
+	struct binder_transaction_data reply;
+	struct bench_binder b;
+	struct bench_txn txn;
+	struct bench_obj reg;
+	size_t offset = 0;
+	pid_t pid;
+	int i;
+
+	pid = fork();
+	if (pid)
+		return pid;
+
+	pin_cpu(index);
+	binder_open(&b);
+
+	memset(&reg, 0, sizeof(reg));
+	reg.obj.type = BINDER_TYPE_BINDER;
+	reg.obj.flags = 0x7f | FLAT_BINDER_FLAG_ACCEPTS_FDS;
+	reg.obj.binder = (void *)(unsigned long)(index + 1);
+	reg.index = index;
+
+	txn_init(&txn, BC_TRANSACTION, 0, CODE_REGISTER, &reg, sizeof(reg),
+		 &offset, sizeof(offset));
+	if (txn_call(&b, &txn, &reply) < 0)
+		die("register");
+	binder_free(&b, reply.data.ptr.buffer);
+
+	for (i = 1; i < nr_threads; i++)
+		start_looper(&b);
+
+	__sync_fetch_and_add(&shared->registered, 1);
+	binder_loop(&b, 0);
+	exit(0);
+}
+
+/* Calls the server registered as 'server', counting as client 'index' */
+static pid_t fork_client(int index, int server)
+{
+	struct binder_transaction_data reply;
+	struct bench_binder b;
+	struct bench_txn txn;
+	struct bench_obj *obj;
+	unsigned long long n = 0, t0, t1;
+	unsigned long long *lat = shared->lat[index];
+	struct flat_binder_object *fbo;
+	size_t offset = 0, size = data_size;
+	uint32_t handle;
+	char *data;
+	pid_t pid;
+
+	pid = fork();
+	if (pid)
+		return pid;
+
+	pin_cpu(index);
+	binder_open(&b);
+
+	txn_init(&txn, BC_TRANSACTION, 0, CODE_LOOKUP, &server, sizeof(uint32_t),
+		 NULL, 0);
+	if (txn_call(&b, &txn, &reply) < 0 ||
+	    reply.data_size != sizeof(*obj) || reply.offsets_size != sizeof(size_t))
+		die("lookup");
+
+	/* the reply buffer holds our ref to the server until we exit */
+	obj = (struct bench_obj *)reply.data.ptr.buffer;
+	handle = obj->obj.handle;
+
+	/*
+	 * The driver tells us about the refs to our binder coming and going,
+	 * to the process rather than to the calling thread. Someone has to
+	 * take that in, as a thread pool would in any real process.
+	 */
+	if (pass_objs)
+		start_looper(&b);
+
+	if (pass_objs && size < sizeof(*fbo))
+		size = sizeof(*fbo);
+	data = calloc(1, size);
+	if (!data)
+		die("calloc");
+	if (pass_objs) {
+		fbo = (struct flat_binder_object *)data;
+		fbo->type = BINDER_TYPE_BINDER;
+		fbo->flags = 0x7f;
+		fbo->binder = (void *)(unsigned long)(index + 1);
+	}
+	txn_init(&txn, BC_TRANSACTION, handle, CODE_PING, data, size,
+		 pass_objs ? &offset : NULL, pass_objs ? sizeof(offset) : 0);
+
+	__sync_fetch_and_add(&shared->ready, 1);
+	while (!shared->start)
+		usleep(1000);
+
+	t0 = now_ns();
+	while (!shared->stop) {
+		if (txn_call(&b, &txn, &reply) < 0)
+			die("transaction");
+		txn.free_buf = (void *)reply.data.ptr.buffer;
+		n++;
+
+		t1 = now_ns();
+		lat[lat_bucket(t1 - t0)]++;
+		t0 = t1;
+	}
+
+	shared->count[index] = n;
+	exit(0);
+}
+
+static void wait_for(volatile int *v, int n, pid_t *pids, int nr_pids)
+{
+	while (*v < n) {
+		if (shared->error) {
+			while (nr_pids--)
+				kill(pids[nr_pids], SIGKILL);
+			exit(1);
+		}
+		usleep(1000);
+	}
+}
+
+static void run_round(int n)
+{
+	pid_t servers[MAX_PAIRS], clients[MAX_PAIRS];
+	unsigned long long total = 0;
+	int nr_servers = shared_server ? 1 : n;
+	struct timespec t0, t1;
+	double secs;
+	int i;
+
+	shared->registered = 0;
+	shared->ready = 0;
+	shared->start = 0;
+	shared->stop = 0;
+	memset(shared->lat, 0, sizeof(shared->lat));
+
+	for (i = 0; i < nr_servers; i++)
+		servers[i] = fork_server(i, shared_server ? n : 1);
+	wait_for(&shared->registered, nr_servers, servers, nr_servers);
+
+	for (i = 0; i < n; i++)
+		clients[i] = fork_client(i, shared_server ? 0 : i);
+	wait_for(&shared->ready, n, clients, n);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	shared->start = 1;
+	sleep(seconds);
+	shared->stop = 1;
+
+	for (i = 0; i < n; i++)
+		waitpid(clients[i], NULL, 0);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	for (i = 0; i < nr_servers; i++) {
+		kill(servers[i], SIGKILL);
+		waitpid(servers[i], NULL, 0);
+	}
+	for (i = 0; i < n; i++)
+		total += shared->count[i];
+	if (shared->error)
+		exit(1);
+
+	secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	printf("%3d %s: %10.0f transactions/s, %8.0f per %s, "
+	       "p50 %7.1f us, p99 %7.1f us\n",
+	       n, shared_server ? "clients" : "pairs", total / secs,
+	       total / secs / n, shared_server ? "client" : "pair",
+	       lat_percentile(n, total, 50), lat_percentile(n, total, 99));
+	fflush(stdout);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-n pairs] [-t seconds] [-s size] [-a] [-S] [-o]\n"
+		"  -n  run rounds of 1 to 'pairs' pairs (default: number of cpus)\n"
+		"  -t  length of a round (default: 3)\n"
+		"  -s  bytes of data per transaction (default: 128)\n"
+		"  -a  pin pair i to cpu i\n"
+		"  -S  make all clients call one multi-threaded server\n"
+		"  -o  pass a binder object in every transaction\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	pid_t ctx_mgr;
+	int opt, n;
+
+	while ((opt = getopt(argc, argv, "n:t:s:aSo")) != -1) {
+		switch (opt) {
+		case 'n':
+			nr_pairs = atoi(optarg);
+			break;
+		case 't':
+			seconds = atoi(optarg);
+			break;
+		case 's':
+			data_size = atoi(optarg);
+			break;
+		case 'a':
+			pin_cpus = 1;
+			break;
+		case 'S':
+			shared_server = 1;
+			break;
+		case 'o':
+			pass_objs = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nr_pairs <= 0)
+		nr_pairs = nr_cpus;
+	if (nr_pairs > MAX_PAIRS || seconds <= 0 || data_size < 0)
+		usage(argv[0]);
+
+	shared = mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shared == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+
+	ctx_mgr = fork_ctx_mgr();
+	wait_for(&shared->ctx_mgr_ready, 1, &ctx_mgr, 1);
+
+	printf("%d cpus, %d bytes per transaction, %d s per round\n",
+	       nr_cpus, data_size, seconds);
+	for (n = 1; n <= nr_pairs; n++)
+		run_round(n);
+
+	kill(ctx_mgr, SIGKILL);
+	waitpid(ctx_mgr, NULL, 0);
+	return 0;
+}